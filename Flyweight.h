@@ -1,9 +1,100 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace Flyweight {
+	// interned names shared by images, caches and pages
+	typedef uint32_t NameID;
+	const NameID noName = UINT32_MAX;
+
+	class NameTable {
+		// block b holds the names from 2^b - 1 on, 2^b of them; blocks are
+		// never reallocated, so views into them stay valid and a name below
+		// namesCount is read without the lock
+		std::string *blocks[32] = {};
+		std::atomic<NameID> namesCount{0};
+		std::unordered_map<std::string_view, NameID> ids;
+		mutable std::shared_mutex mutex;
+
+		static int blockOf(NameID id) {
+			return 31 - __builtin_clz(id + 1);
+		}
+		std::string &at(NameID id) const {
+			int block = blockOf(id);
+			return blocks[block][id + 1 - (1u << block)];
+		}
+	public:
+		static NameTable *getSI() {
+			static NameTable sharedInstance;
+			return &sharedInstance;
+		}
+		NameTable() = default;
+		NameTable(const NameTable &) = delete;
+		NameTable &operator=(const NameTable &) = delete;
+		~NameTable() {
+			for (std::string *block : blocks)
+				delete[] block;
+		}
+		NameID intern(std::string_view name) {
+			{
+				std::shared_lock<std::shared_mutex> lock(mutex);
+				auto it = ids.find(name);
+				if (it != ids.end())
+					return it -> second;
+			}
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			auto it = ids.find(name);
+			if (it != ids.end())
+				return it -> second;
+			NameID id = namesCount.load(std::memory_order_relaxed);
+			if (id == noName) throw "Error!";
+			int block = blockOf(id);
+			if (!blocks[block])
+				blocks[block] = new std::string[(size_t)1 << block];
+			at(id) = name;
+			ids.emplace(at(id), id);
+			namesCount.store(id + 1, std::memory_order_release);
+			return id;
+		}
+		NameID find(std::string_view name) const {
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			auto it = ids.find(name);
+			return it != ids.end() ? it -> second : noName;
+		}
+		const std::string &name(NameID id) const {
+			if (id >= namesCount.load(std::memory_order_acquire)) throw "Error!";
+			return at(id);
+		}
+	};
+
 	// extrinsic (non-shareable) state
 	class Frame {
 		int x, y, w, h;
@@ -12,6 +103,7 @@ namespace Flyweight {
 			x = xx; y = yy; w = ww; h = hh;
 		}
 		friend std::ostream &operator<<(std::ostream &os, const Frame &frame);
+		friend class DrawList;
 	};
 	
 	std::ostream &operator<<(std::ostream &os, const Frame &frame) {
@@ -23,45 +115,428 @@ namespace Flyweight {
 	// flyweight
 	class Image {
 		// intrinsic (shareable) state
-		std::string name;
+		NameID id;
+		const std::string *name;
+		// pixel data, owned by whoever loaded the image (e.g. a mapped pack)
+		const unsigned char *bytes;
+		size_t length;
 	public:
-		Image(std::string aName) {
-			name = aName;
+		Image(NameID anID, const unsigned char *someBytes = nullptr, size_t aLength = 0) {
+			id = anID;
+			name = &NameTable::getSI() -> name(id);
+			bytes = someBytes;
+			length = aLength;
 		}
-		const std::string &getName() {
-			return name;
+		Image(std::string_view aName) : Image(NameTable::getSI() -> intern(aName)) {
 		}
-		void draw(Frame frame) const {
-			std::cout << "Drawing Image [" << name << "] ";
-			std::cout << "in frame " << frame;
-			std::cout << std::endl;
+		NameID getID() const {
+			return id;
+		}
+		const std::string &getName() const {
+			return *name;
+		}
+		const unsigned char *getBytes() const {
+			return bytes;
+		}
+		size_t getLength() const {
+			return length;
+		}
+		// intrinsic footprint, used for cache byte budgets
+		size_t getSize() const {
+			return sizeof(Image) + name -> size() + length;
+		}
+		void draw(Frame frame, std::ostream &os = std::cout) const {
+			os << "Drawing Image [" << *name << "] ";
+			os << "in frame " << frame;
+			os << std::endl;
 		}
 	};
 	
+	// draw commands of a whole page, frames kept as structure of arrays
+	class DrawList {
+		std::vector<NameID> imageIDs;
+		std::vector<const std::string *> names;
+		std::vector<int> xs, ys, ws, hs;
+		// right and bottom edges, saturated to int so cull adds nothing up
+		std::vector<int> rights, bottoms;
+		std::vector<unsigned char> visible;
+		std::string buffer;
+
+		void append(const char *text, size_t length) {
+			buffer.append(text, length);
+		}
+		void append(int value) {
+			char digits[16];
+			auto result = std::to_chars(digits, digits + sizeof(digits), value);
+			buffer.append(digits, result.ptr);
+		}
+		static int edge(int position, int size) {
+			return (int)std::clamp<int64_t>((int64_t)position + size, INT_MIN, INT_MAX);
+		}
+		// branch-free so the compiler can vectorize it, the arrays are
+		// distinct so it needs no alias check either
+		static void cull(size_t n, const int *__restrict x, const int *__restrict y, const int *__restrict r, const int *__restrict b, unsigned char *__restrict v, const Frame &clip) {
+			int left = clip.x, top = clip.y, right = edge(clip.x, clip.w), bottom = edge(clip.y, clip.h);
+			for (size_t i = 0; i < n; ++i)
+				v[i] = (x[i] <= right) & (r[i] >= left) & (y[i] <= bottom) & (b[i] >= top);
+		}
+		void cull(const Frame &clip) {
+			visible.resize(xs.size());
+			cull(xs.size(), xs.data(), ys.data(), rights.data(), bottoms.data(), visible.data(), clip);
+		}
+	public:
+		void reserve(size_t n) {
+			imageIDs.reserve(n);
+			names.reserve(n);
+			xs.reserve(n); ys.reserve(n); ws.reserve(n); hs.reserve(n);
+			rights.reserve(n); bottoms.reserve(n);
+		}
+		void record(const Image &image, const Frame &frame) {
+			imageIDs.push_back(image.getID());
+			names.push_back(&image.getName());
+			xs.push_back(frame.x); ys.push_back(frame.y); ws.push_back(frame.w); hs.push_back(frame.h);
+			rights.push_back(edge(frame.x, frame.w)); bottoms.push_back(edge(frame.y, frame.h));
+		}
+		size_t size() const {
+			return imageIDs.size();
+		}
+		void clear() {
+			imageIDs.clear();
+			names.clear();
+			xs.clear(); ys.clear(); ws.clear(); hs.clear();
+			rights.clear(); bottoms.clear();
+		}
+		// formats every recorded draw inside clip (all when null),
+		// writes them with a single stream write and clears the list
+		void flush(std::ostream &os, const Frame *clip = nullptr) {
+			size_t n = size();
+			if (clip)
+				cull(*clip);
+			else
+				visible.assign(n, 1);
+			buffer.clear();
+			for (size_t i = 0; i < n; ++i) {
+				if (!visible[i])
+					continue;
+				append("Drawing Image [", 15);
+				append(names[i] -> data(), names[i] -> size());
+				append("] in frame Origin {x : ", 23);
+				append(xs[i]);
+				append(", y : ", 6);
+				append(ys[i]);
+				append("} Size {w : ", 12);
+				append(ws[i]);
+				append(", h : ", 6);
+				append(hs[i]);
+				append("}\n", 2);
+			}
+			os.write(buffer.data(), buffer.size());
+			os.flush();
+			clear();
+		}
+	};
+
+	// power-of-two latency buckets, lock-free to record
+	class LatencyHistogram {
+	public:
+		static const int bucketsCount = 64;
+		struct Snapshot {
+			uint64_t counts[bucketsCount] = {};
+			uint64_t total = 0;
+			// upper bound of the bucket holding the given quantile, in ns
+			uint64_t percentile(double quantile) const {
+				uint64_t rank = (uint64_t)(quantile * total), seen = 0;
+				for (int bucket = 0; bucket < bucketsCount; ++bucket) {
+					seen += counts[bucket];
+					if (seen > rank)
+						return bucket < 63 ? (2ull << bucket) - 1 : UINT64_MAX;
+				}
+				return 0;
+			}
+		};
+	private:
+		std::atomic<uint64_t> counts[bucketsCount] = {};
+	public:
+		void record(std::chrono::nanoseconds latency) {
+			uint64_t ns = latency.count() > 0 ? latency.count() : 1;
+			int bucket = 63 - __builtin_clzll(ns);
+			counts[bucket].fetch_add(1, std::memory_order_relaxed);
+		}
+		Snapshot snapshot() const {
+			Snapshot snapshot;
+			for (int bucket = 0; bucket < bucketsCount; ++bucket) {
+				snapshot.counts[bucket] = counts[bucket].load(std::memory_order_relaxed);
+				snapshot.total += snapshot.counts[bucket];
+			}
+			return snapshot;
+		}
+	};
+
+	// counters reported by the caches of a loader chain
+	class CacheStats {
+	public:
+		struct Snapshot {
+			uint64_t hits, misses, loads, evictions;
+			LatencyHistogram::Snapshot lookupLatency, loadLatency;
+		};
+		std::atomic<uint64_t> hits{0}, misses{0}, loads{0}, evictions{0};
+		LatencyHistogram lookupLatency, loadLatency;
+
+		Snapshot snapshot() const {
+			return {hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed),
+				loads.load(std::memory_order_relaxed), evictions.load(std::memory_order_relaxed),
+				lookupLatency.snapshot(), loadLatency.snapshot()};
+		}
+	};
+
+	std::ostream &operator<<(std::ostream &os, const CacheStats::Snapshot &snapshot) {
+		os << "hits : " << snapshot.hits << ", misses : " << snapshot.misses;
+		os << ", loads : " << snapshot.loads << ", evictions : " << snapshot.evictions << std::endl;
+		os << "lookup p50/p99 : <= " << snapshot.lookupLatency.percentile(0.5) << "/";
+		os << snapshot.lookupLatency.percentile(0.99) << " ns" << std::endl;
+		os << "load p50/p99 : <= " << snapshot.loadLatency.percentile(0.5) << "/";
+		os << snapshot.loadLatency.percentile(0.99) << " ns";
+		return os;
+	}
+
 	// simple factory
 	class BaseImageLoader {
 	public:
 		BaseImageLoader() {}
 		virtual ~BaseImageLoader() {};
-		virtual Image *loadImage(std::string &imageName) = 0;
-		virtual const Image *getImage(std::string &imageName) = 0;
+		virtual Image *loadImage(NameID imageID) = 0;
+		virtual const Image *getImage(NameID imageID) = 0;
+		// handle that keeps the image alive while in use; non-owning by default
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return std::shared_ptr<const Image>(std::shared_ptr<const Image>(), getImage(imageID));
+		}
+		// lookups by name; a class overriding the NameID versions brings
+		// these back into scope with using declarations
+		const Image *getImage(std::string_view imageName) {
+			return getImage(NameTable::getSI() -> intern(imageName));
+		}
+		std::shared_ptr<const Image> acquireImage(std::string_view imageName) {
+			return acquireImage(NameTable::getSI() -> intern(imageName));
+		}
+		// hands the counters down the chain, loaders without a cache ignore them
+		virtual void attachStats(CacheStats *) {
+		}
 	};
 	
 	class ImageLoader : public BaseImageLoader {
 	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
 		virtual ~ImageLoader() {}
-		virtual Image *loadImage(std::string &imageName) {
-			return new Image(imageName);
+		virtual Image *loadImage(NameID imageID) {
+			return new Image(imageID);
 		}
-		virtual const Image *getImage(std::string &imageName) {
-			return ImageLoader::loadImage(imageName);
+		virtual const Image *getImage(NameID imageID) {
+			return ImageLoader::loadImage(imageID);
+		}
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return std::shared_ptr<const Image>(ImageLoader::loadImage(imageID));
+		}
+	};
+	
+	// asset pack layout, in the byte order of the host that wrote it:
+	//   header : magic "FWPK", version, entries count, reserved,
+	//            index offset, FNV-1a checksum of the header fields before
+	//            it and of everything after the header
+	//   data   : image bytes back to back
+	//   index  : per entry offset (8), length (8), name length (4), name
+	struct AssetPackHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t count;
+		uint32_t reserved;
+		uint64_t indexOffset;
+		uint64_t checksum;
+	};
+
+	// continues from hash, to checksum discontiguous bytes
+	uint64_t checksumFNV1a(const unsigned char *bytes, size_t length, uint64_t hash = 14695981039346656037ull) {
+		for (size_t i = 0; i < length; ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// builder
+	class AssetPackBuilder {
+		struct Entry {
+			std::string name;
+			uint64_t offset;
+			uint64_t length;
+		};
+		std::vector<Entry> entries;
+		std::vector<unsigned char> data;
+
+		template <class T>
+		static void put(std::vector<unsigned char> &out, T value) {
+			const unsigned char *p = (const unsigned char *)&value;
+			out.insert(out.end(), p, p + sizeof(T));
+		}
+	public:
+		void add(std::string_view name, const void *bytes, size_t length) {
+			entries.push_back({std::string(name), data.size(), length});
+			data.insert(data.end(), (const unsigned char *)bytes, (const unsigned char *)bytes + length);
+		}
+		void addFile(std::string_view name, const std::string &path) {
+			std::ifstream file(path, std::ios::binary);
+			if (!file) throw "Error!";
+			std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			add(name, bytes.data(), bytes.size());
+		}
+		void write(const std::string &path) const {
+			std::vector<unsigned char> body(data);
+			for (auto &entry : entries) {
+				put<uint64_t>(body, entry.offset + sizeof(AssetPackHeader));
+				put<uint64_t>(body, entry.length);
+				put<uint32_t>(body, (uint32_t)entry.name.size());
+				body.insert(body.end(), entry.name.begin(), entry.name.end());
+			}
+			AssetPackHeader header = {{'F', 'W', 'P', 'K'}, 2, (uint32_t)entries.size(), 0, sizeof(AssetPackHeader) + data.size(), 0};
+			header.checksum = checksumFNV1a(body.data(), body.size(), checksumFNV1a((const unsigned char *)&header, offsetof(AssetPackHeader, checksum)));
+
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			file.write((const char *)&header, sizeof(header));
+			file.write((const char *)body.data(), body.size());
+			if (!file) throw "Error!";
+		}
+	};
+
+	// read-only memory-mapped pack, rejected at open time when corrupt
+	class AssetPack {
+		struct Blob {
+			const unsigned char *bytes = nullptr;
+			size_t length = 0;
+		};
+		const unsigned char *base = nullptr;
+		size_t size = 0;
+		// indexed by NameID
+		std::vector<Blob> blobs;
+
+		void parse() {
+			AssetPackHeader header;
+			if (size < sizeof(header)) throw "Error!";
+			memcpy(&header, base, sizeof(header));
+			if (memcmp(header.magic, "FWPK", 4) || header.version != 2) throw "Error!";
+			if (header.indexOffset < sizeof(header) || header.indexOffset > size) throw "Error!";
+			uint64_t checksum = checksumFNV1a(base, offsetof(AssetPackHeader, checksum));
+			if (checksumFNV1a(base + sizeof(header), size - sizeof(header), checksum) != header.checksum) throw "Error!";
+
+			NameTable *names = NameTable::getSI();
+			size_t pos = header.indexOffset;
+			for (uint32_t i = 0; i < header.count; ++i) {
+				uint64_t offset, length;
+				uint32_t nameLength;
+				if (size - pos < 20) throw "Error!";
+				memcpy(&offset, base + pos, 8);
+				memcpy(&length, base + pos + 8, 8);
+				memcpy(&nameLength, base + pos + 16, 4);
+				pos += 20;
+				// a blob lies between the header and the index
+				if (size - pos < nameLength || offset < sizeof(header) || offset > header.indexOffset || length > header.indexOffset - offset) throw "Error!";
+				NameID id = names -> intern(std::string_view((const char *)base + pos, nameLength));
+				pos += nameLength;
+				if (id >= blobs.size())
+					blobs.resize(id + 1);
+				blobs[id].bytes = base + offset;
+				blobs[id].length = length;
+			}
+			// the index runs to the end of the pack, nothing more or less
+			if (pos != size) throw "Error!";
+		}
+		AssetPack(const AssetPack &) = delete;
+		AssetPack &operator=(const AssetPack &) = delete;
+	public:
+		AssetPack(const std::string &path) {
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw "Error!";
+			struct stat st;
+			if (fstat(fd, &st) < 0 || st.st_size == 0) {
+				close(fd);
+				throw "Error!";
+			}
+			size = st.st_size;
+			void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapped == MAP_FAILED) throw "Error!";
+			base = (const unsigned char *)mapped;
+			try {
+				parse();
+			} catch (...) {
+				munmap((void *)base, size);
+				throw;
+			}
+		}
+		~AssetPack() {
+			munmap((void *)base, size);
+			base = nullptr;
+		}
+		bool find(NameID imageID, const unsigned char *&bytes, size_t &length) const {
+			if (imageID >= blobs.size() || !blobs[imageID].bytes)
+				return false;
+			bytes = blobs[imageID].bytes;
+			length = blobs[imageID].length;
+			return true;
+		}
+	};
+
+	// images reference the mapped bytes in place, so the loader
+	// (and its pack) must outlive every image it loads
+	class PackImageLoader : public BaseImageLoader {
+		AssetPack *pack;
+	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
+		PackImageLoader(AssetPack *aPack) : BaseImageLoader() {
+			pack = aPack;
+			if (!pack) throw "Error!";
+		}
+		virtual ~PackImageLoader() {
+			delete pack;
+			pack = nullptr;
+		}
+		virtual Image *loadImage(NameID imageID) {
+			const unsigned char *bytes;
+			size_t length;
+			if (!pack -> find(imageID, bytes, length)) throw "Error!";
+			return new Image(imageID, bytes, length);
+		}
+		virtual const Image *getImage(NameID imageID) {
+			return PackImageLoader::loadImage(imageID);
+		}
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return std::shared_ptr<const Image>(PackImageLoader::loadImage(imageID));
 		}
 	};
 	
 	// decorator
 	class ImageLoaderAddon : public BaseImageLoader {
 		BaseImageLoader *imageLoader;
+	protected:
+		CacheStats *stats = nullptr;
+
+		// loads through the next loader, timed when stats are attached
+		Image *loadAndRecord(NameID imageID) {
+			if (!stats)
+				return ImageLoaderAddon::loadImage(imageID);
+			auto start = std::chrono::steady_clock::now();
+			Image *image = ImageLoaderAddon::loadImage(imageID);
+			stats -> loadLatency.record(std::chrono::steady_clock::now() - start);
+			stats -> loads.fetch_add(1, std::memory_order_relaxed);
+			return image;
+		}
+		void recordLookup(bool hit) {
+			if (stats)
+				(hit ? stats -> hits : stats -> misses).fetch_add(1, std::memory_order_relaxed);
+		}
 	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
 		ImageLoaderAddon(BaseImageLoader *anImageLoader = nullptr) : BaseImageLoader() {
 			imageLoader = anImageLoader;
 			if (!imageLoader) throw "Error!";
@@ -70,11 +545,18 @@ namespace Flyweight {
 			delete imageLoader;
 			imageLoader = nullptr;
 		}
-		virtual Image *loadImage(std::string &imageName) {
-			return imageLoader -> loadImage(imageName);
+		virtual Image *loadImage(NameID imageID) {
+			return imageLoader -> loadImage(imageID);
+		}
+		virtual const Image *getImage(NameID imageID) {
+			return imageLoader -> getImage(imageID);
 		}
-		virtual const Image *getImage(std::string &imageName) {
-			return imageLoader -> getImage(imageName);
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return imageLoader -> acquireImage(imageID);
+		}
+		virtual void attachStats(CacheStats *someStats) {
+			stats = someStats;
+			imageLoader -> attachStats(someStats);
 		}
 	};
 	
@@ -82,48 +564,522 @@ namespace Flyweight {
 //	};
 	
 	class Cache : public ImageLoaderAddon {
-		std::unordered_map<std::string, Image *> cache;
+		// indexed by the dense interned IDs
+		std::vector<Image *> cache;
 	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
 		Cache(BaseImageLoader *anImageLoader) : ImageLoaderAddon(anImageLoader) {}
 		virtual ~Cache() {
-			for (auto &entry : cache) {
-				delete entry.second;
-				entry.second = nullptr;
+			for (auto &image : cache) {
+				delete image;
+				image = nullptr;
 			}
 		}
-		virtual const Image *getImage(std::string &imageName) {
-			if (!cache.count(imageName)) {
-				std::cout << "Loading Image [" << imageName << "] " << std::endl;
-				cache[imageName] = ImageLoaderAddon::loadImage(imageName);
+		virtual const Image *getImage(NameID imageID) {
+			if (imageID >= cache.size())
+				cache.resize(imageID + 1, nullptr);
+			Image *&image = cache[imageID];
+			recordLookup(image);
+			if (!image) {
+				std::cout << "Loading Image [" << NameTable::getSI() -> name(imageID) << "] " << std::endl;
+				image = loadAndRecord(imageID);
 			} else
-				std::cout << "Reusing Image [" << imageName << "] " << std::endl;
+				std::cout << "Reusing Image [" << image -> getName() << "] " << std::endl;
 				
-			return cache[imageName];
+			return image;
+		}
+		// cached images live as long as the cache
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return BaseImageLoader::acquireImage(imageID);
+		}
+	};
+
+	// thread-safe cache: lock-striped shards, single-flight loading
+	class ConcurrentCache : public ImageLoaderAddon {
+		struct Entry {
+			std::once_flag loaded;
+			Image *image = nullptr;
+		};
+		struct alignas(64) Shard {
+			std::mutex mutex;
+			std::unordered_map<NameID, Entry> entries;
+		};
+		std::vector<Shard> shards;
+
+		Shard &shardFor(NameID imageID) {
+			return shards[imageID % shards.size()];
+		}
+	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
+		ConcurrentCache(BaseImageLoader *anImageLoader, size_t shardsCount = 16) : ImageLoaderAddon(anImageLoader), shards(shardsCount ? shardsCount : 1) {}
+		virtual ~ConcurrentCache() {
+			for (auto &shard : shards)
+				for (auto &entry : shard.entries) {
+					delete entry.second.image;
+					entry.second.image = nullptr;
+				}
+		}
+		virtual const Image *getImage(NameID imageID) {
+			Shard &shard = shardFor(imageID);
+			Entry *entry;
+			{
+				// single find-or-insert; map nodes keep the entry address stable
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				entry = &shard.entries[imageID];
+			}
+			// the first caller loads outside the shard lock, the rest wait for it
+			bool loaded = false;
+			std::call_once(entry -> loaded, [&] {
+				entry -> image = loadAndRecord(imageID);
+				loaded = true;
+			});
+			recordLookup(!loaded);
+			return entry -> image;
+		}
+		// cached images live as long as the cache
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			return BaseImageLoader::acquireImage(imageID);
+		}
+	};
+	
+	// eviction policies (strategy)
+	class EvictionPolicy {
+	public:
+		virtual ~EvictionPolicy() {}
+		virtual void recordInsert(NameID imageID) = 0;
+		virtual void recordAccess(NameID imageID) = 0;
+		virtual void recordErase(NameID imageID) = 0;
+		virtual void recordMiss(NameID) {}
+		// next entry to evict, the policy must not be empty
+		virtual NameID victim() = 0;
+		// whether a new entry is worth evicting the victim for
+		virtual bool admit(NameID, NameID) {
+			return true;
+		}
+	};
+
+	class LRUPolicy : public EvictionPolicy {
+		std::list<NameID> order;
+		std::unordered_map<NameID, std::list<NameID>::iterator> positions;
+	public:
+		virtual void recordInsert(NameID imageID) {
+			order.push_front(imageID);
+			positions[imageID] = order.begin();
+		}
+		virtual void recordAccess(NameID imageID) {
+			auto it = positions.find(imageID);
+			if (it != positions.end())
+				order.splice(order.begin(), order, it -> second);
+		}
+		virtual void recordErase(NameID imageID) {
+			auto it = positions.find(imageID);
+			if (it == positions.end())
+				return;
+			order.erase(it -> second);
+			positions.erase(it);
+		}
+		virtual NameID victim() {
+			return order.back();
+		}
+	};
+
+	class ClockPolicy : public EvictionPolicy {
+		struct Slot {
+			NameID imageID;
+			bool referenced;
+			bool used;
+		};
+		std::vector<Slot> slots;
+		std::vector<size_t> freeSlots;
+		std::unordered_map<NameID, size_t> positions;
+		size_t hand = 0;
+	public:
+		virtual void recordInsert(NameID imageID) {
+			size_t slot;
+			if (!freeSlots.empty()) {
+				slot = freeSlots.back();
+				freeSlots.pop_back();
+				slots[slot] = {imageID, false, true};
+			} else {
+				slot = slots.size();
+				slots.push_back({imageID, false, true});
+			}
+			positions[imageID] = slot;
+		}
+		virtual void recordAccess(NameID imageID) {
+			auto it = positions.find(imageID);
+			if (it != positions.end())
+				slots[it -> second].referenced = true;
+		}
+		virtual void recordErase(NameID imageID) {
+			auto it = positions.find(imageID);
+			if (it == positions.end())
+				return;
+			slots[it -> second] = {noName, false, false};
+			freeSlots.push_back(it -> second);
+			positions.erase(it);
+		}
+		virtual NameID victim() {
+			for (;; hand = (hand + 1) % slots.size()) {
+				Slot &slot = slots[hand];
+				if (!slot.used)
+					continue;
+				if (!slot.referenced)
+					return slot.imageID;
+				slot.referenced = false;
+			}
+		}
+	};
+
+	// TinyLFU admission filter in front of another policy (decorator)
+	class TinyLFUPolicy : public EvictionPolicy {
+		EvictionPolicy *policy;
+		std::vector<unsigned char> sketch;
+		size_t mask;
+		size_t samples = 0;
+		size_t sampleSize;
+
+		size_t index(size_t hash, int row) const {
+			return row * (mask + 1) + (((hash >> (row * 16)) ^ (hash * (2 * row + 1))) & mask);
+		}
+		void increment(NameID imageID) {
+			size_t hash = imageID * 0x9E3779B97F4A7C15ull;
+			for (int row = 0; row < 4; ++row) {
+				unsigned char &counter = sketch[index(hash, row)];
+				if (counter < 15)
+					++counter;
+			}
+			// aging: halve all counters once enough samples were seen
+			if (++samples >= sampleSize) {
+				for (auto &counter : sketch)
+					counter >>= 1;
+				samples /= 2;
+			}
+		}
+		unsigned frequency(NameID imageID) const {
+			size_t hash = imageID * 0x9E3779B97F4A7C15ull;
+			unsigned estimate = 15;
+			for (int row = 0; row < 4; ++row)
+				estimate = std::min<unsigned>(estimate, sketch[index(hash, row)]);
+			return estimate;
+		}
+	public:
+		TinyLFUPolicy(EvictionPolicy *aPolicy, size_t width = 1024) : policy(aPolicy) {
+			if (!policy) throw "Error!";
+			size_t w = 1;
+			while (w < width)
+				w <<= 1;
+			mask = w - 1;
+			sketch.assign(4 * w, 0);
+			sampleSize = 10 * w;
+		}
+		virtual ~TinyLFUPolicy() {
+			delete policy;
+			policy = nullptr;
+		}
+		virtual void recordInsert(NameID imageID) {
+			policy -> recordInsert(imageID);
+		}
+		virtual void recordAccess(NameID imageID) {
+			increment(imageID);
+			policy -> recordAccess(imageID);
+		}
+		virtual void recordErase(NameID imageID) {
+			policy -> recordErase(imageID);
+		}
+		virtual void recordMiss(NameID imageID) {
+			increment(imageID);
+			policy -> recordMiss(imageID);
+		}
+		virtual NameID victim() {
+			return policy -> victim();
+		}
+		virtual bool admit(NameID candidate, NameID victim) {
+			return frequency(candidate) > frequency(victim) && policy -> admit(candidate, victim);
+		}
+	};
+
+	// memory-bounded cache, evicted images live on while handles to them exist
+	class BoundedCache : public ImageLoaderAddon {
+		struct Entry {
+			std::shared_ptr<const Image> image;
+			size_t size;
+		};
+		std::mutex mutex;
+		std::unordered_map<NameID, Entry> entries;
+		EvictionPolicy *policy;
+		size_t budget;
+		size_t used = 0;
+		std::shared_ptr<const Image> lastImage;
+	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
+		BoundedCache(BaseImageLoader *anImageLoader, size_t aBudget, EvictionPolicy *aPolicy = nullptr) : ImageLoaderAddon(anImageLoader), budget(aBudget) {
+			policy = aPolicy ? aPolicy : new LRUPolicy();
+		}
+		virtual ~BoundedCache() {
+			delete policy;
+			policy = nullptr;
+		}
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = entries.find(imageID);
+				recordLookup(it != entries.end());
+				if (it != entries.end()) {
+					policy -> recordAccess(imageID);
+					return it -> second.image;
+				}
+				policy -> recordMiss(imageID);
+			}
+			// load outside the lock; a racing loader of the same image loses
+			std::shared_ptr<const Image> image(loadAndRecord(imageID));
+			size_t size = image -> getSize();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = entries.find(imageID);
+			if (it != entries.end())
+				return it -> second.image;
+			if (size > budget)
+				return image;
+			while (used + size > budget) {
+				NameID victim = policy -> victim();
+				if (!policy -> admit(imageID, victim))
+					return image;
+				auto victimIt = entries.find(victim);
+				used -= victimIt -> second.size;
+				policy -> recordErase(victim);
+				entries.erase(victimIt);
+				if (stats)
+					stats -> evictions.fetch_add(1, std::memory_order_relaxed);
+			}
+			entries.emplace(imageID, Entry{image, size});
+			used += size;
+			policy -> recordInsert(imageID);
+			return image;
+		}
+		// the pointer stays valid until the next getImage call,
+		// use acquireImage to keep an image for longer
+		virtual const Image *getImage(NameID imageID) {
+			std::shared_ptr<const Image> image = acquireImage(imageID);
+			std::lock_guard<std::mutex> lock(mutex);
+			lastImage = image;
+			return image.get();
+		}
+		size_t usedBytes() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return used;
+		}
+		size_t imagesCount() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return entries.size();
 		}
 	};
 	
-	static std::unordered_map<std::string, std::vector<std::string>> www = {
+	// statistics decorator: times lookups and collects the counters of the caches below
+	class Statistics : public ImageLoaderAddon {
+		CacheStats counters;
+	public:
+		using BaseImageLoader::getImage;
+		using BaseImageLoader::acquireImage;
+		Statistics(BaseImageLoader *anImageLoader) : ImageLoaderAddon(anImageLoader) {
+			ImageLoaderAddon::attachStats(&counters);
+		}
+		virtual ~Statistics() {}
+		virtual const Image *getImage(NameID imageID) {
+			auto start = std::chrono::steady_clock::now();
+			const Image *image = ImageLoaderAddon::getImage(imageID);
+			counters.lookupLatency.record(std::chrono::steady_clock::now() - start);
+			return image;
+		}
+		virtual std::shared_ptr<const Image> acquireImage(NameID imageID) {
+			auto start = std::chrono::steady_clock::now();
+			std::shared_ptr<const Image> image = ImageLoaderAddon::acquireImage(imageID);
+			counters.lookupLatency.record(std::chrono::steady_clock::now() - start);
+			return image;
+		}
+		// this decorator owns its counters
+		virtual void attachStats(CacheStats *) {
+		}
+		CacheStats::Snapshot snapshot() const {
+			return counters.snapshot();
+		}
+	};
+
+	typedef std::unordered_map<NameID, std::vector<NameID>> Pages;
+	Pages internPages(std::initializer_list<std::pair<const char *, std::vector<const char *>>> pages) {
+		NameTable *names = NameTable::getSI();
+		Pages internedPages;
+		for (auto &page : pages) {
+			std::vector<NameID> &imageIDs = internedPages[names -> intern(page.first)];
+			for (auto imageName : page.second)
+				imageIDs.push_back(names -> intern(imageName));
+		}
+		return internedPages;
+	}
+
+	static Pages www = internPages({
 		{"page1.html", {"img1.png", "img2.png", "img3.png"}},
 		{"page2.html", {"img2.png", "img4.png"}},
 		{"page3.html", {"img1.png", "img4.png", "img5.png", "img6.png"}}
-	};
+	});
 	
+	// fixed-size thread pool running image loads; speculative loads wait
+	// in their own queue until no page load is queued
+	class LoaderPool {
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()>> tasks;
+		std::deque<std::function<void()>> hints;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool stopping = false;
+	public:
+		LoaderPool(size_t threadsCount) {
+			for (size_t i = 0; i < threadsCount; ++i)
+				workers.emplace_back([this] {
+					for (;;) {
+						std::function<void()> task;
+						{
+							std::unique_lock<std::mutex> lock(mutex);
+							cv.wait(lock, [this] { return stopping || !tasks.empty() || !hints.empty(); });
+							std::deque<std::function<void()>> &queue = !tasks.empty() || stopping ? tasks : hints;
+							if (queue.empty())
+								return;
+							task = std::move(queue.front());
+							queue.pop_front();
+						}
+						task();
+					}
+				});
+		}
+		// finishes the queued tasks before joining, drops the queued hints
+		~LoaderPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			cv.notify_all();
+			for (auto &worker : workers)
+				worker.join();
+		}
+		void submit(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				tasks.push_back(std::move(task));
+			}
+			cv.notify_one();
+		}
+		void submitHint(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				hints.push_back(std::move(task));
+			}
+			cv.notify_one();
+		}
+	};
+
 	class Browser {
 		BaseImageLoader *imageLoader;
+		LoaderPool *loaderPool;
+
+		void prefetchAndDraw(const std::vector<NameID> &imageIDs, DrawList &drawList, std::ostream &os) {
+			struct Completion {
+				std::mutex mutex;
+				std::condition_variable cv;
+				std::vector<std::shared_ptr<const Image>> ready;
+				// the first failed load, rethrown once the page is drained
+				std::exception_ptr error;
+			} completion;
+			// all loads go out at once, each image is drawn as soon as it arrives
+			for (NameID imageID : imageIDs)
+				loaderPool -> submit([this, imageID, &completion] {
+					std::shared_ptr<const Image> image;
+					std::exception_ptr error;
+					try {
+						image = imageLoader -> acquireImage(imageID);
+					} catch (...) {
+						error = std::current_exception();
+					}
+					std::lock_guard<std::mutex> lock(completion.mutex);
+					completion.ready.push_back(image);
+					if (error && !completion.error)
+						completion.error = error;
+					completion.cv.notify_one();
+				});
+			std::vector<std::shared_ptr<const Image>> batch;
+			for (size_t drawn = 0; drawn < imageIDs.size(); ) {
+				{
+					std::unique_lock<std::mutex> lock(completion.mutex);
+					completion.cv.wait(lock, [&completion] { return !completion.ready.empty(); });
+					batch.swap(completion.ready);
+				}
+				for (auto &image : batch)
+					if (image)
+						drawList.record(*image, Frame());
+				drawList.flush(os);
+				drawn += batch.size();
+				batch.clear();
+			}
+			// no task refers to completion any more
+			if (completion.error)
+				std::rethrow_exception(completion.error);
+		}
 	public:
-		Browser() {
-			imageLoader = new Cache(new ImageLoader());
+		// prefetching loads images from several threads, so it needs a
+		// thread-safe loader and defaults to a ConcurrentCache
+		Browser(BaseImageLoader *anImageLoader = nullptr, size_t prefetchThreadsCount = 0) {
+			loaderPool = prefetchThreadsCount ? new LoaderPool(prefetchThreadsCount) : nullptr;
+			if (anImageLoader)
+				imageLoader = anImageLoader;
+			else if (loaderPool)
+				imageLoader = new ConcurrentCache(new ImageLoader());
+			else
+				imageLoader = new Cache(new ImageLoader());
 		}
 		~Browser() {
+			delete loaderPool;
+			loaderPool = nullptr;
 			delete imageLoader;
 			imageLoader = nullptr;
 		}
-		void drawPage(std::string &pageName) {
-			std::vector<std::string> &imageNames = www.at(pageName);
-			std::cout << "Drawing Page [" << pageName << "] " << std::endl;
-			for (auto &imageName : imageNames) {
-				const Image *image = imageLoader -> getImage(imageName);
-				image -> draw(Frame());
+		void drawPage(NameID pageID, DrawList &drawList, std::ostream &os = std::cout) {
+			const std::vector<NameID> &imageIDs = www.at(pageID);
+			os << "Drawing Page [" << NameTable::getSI() -> name(pageID) << "] " << std::endl;
+			if (loaderPool) {
+				prefetchAndDraw(imageIDs, drawList, os);
+				return;
+			}
+			drawList.reserve(imageIDs.size());
+			for (NameID imageID : imageIDs) {
+				std::shared_ptr<const Image> image = imageLoader -> acquireImage(imageID);
+				drawList.record(*image, Frame());
+			}
+			drawList.flush(os);
+		}
+		void drawPage(NameID pageID, std::ostream &os = std::cout) {
+			DrawList drawList;
+			drawPage(pageID, drawList, os);
+		}
+		void drawPage(std::string_view pageName, std::ostream &os = std::cout) {
+			drawPage(NameTable::getSI() -> find(pageName), os);
+		}
+		// warms the images of pages likely to be drawn next
+		void hintPages(const std::vector<std::string_view> &pageNames) {
+			if (!loaderPool)
+				return;
+			for (auto pageName : pageNames) {
+				auto page = www.find(NameTable::getSI() -> find(pageName));
+				if (page == www.end())
+					continue;
+				for (NameID imageID : page -> second)
+					loaderPool -> submitHint([this, imageID] {
+						try {
+							imageLoader -> acquireImage(imageID);
+						} catch (...) {
+						}
+					});
 			}
 		}
 	};
@@ -138,5 +1094,125 @@ namespace Flyweight {
 		for (auto &pageName : pageNames)
 			b -> drawPage(pageName);
 		delete b;
+
+		// room for about three images
+		size_t budget = 3 * Image("img1.png").getSize();
+		BoundedCache *cache = new BoundedCache(new ImageLoader(), budget, new TinyLFUPolicy(new ClockPolicy()));
+		Statistics *statistics = new Statistics(cache);
+		b = new Browser(statistics);
+		for (auto &pageName : pageNames)
+			b -> drawPage(pageName);
+		std::cout << "Bounded cache holds " << cache -> imagesCount() << " images in ";
+		std::cout << cache -> usedBytes() << " of " << budget << " bytes" << std::endl;
+		std::cout << statistics -> snapshot() << std::endl;
+		delete b;
+
+		// only the sprites inside the 100x100 viewport are written
+		DrawList drawList;
+		Image sprite("sprite.png");
+		for (int i = 0; i < 4; ++i)
+			drawList.record(sprite, Frame(i * 60, i * 60, 50, 50));
+		Frame viewport(0, 0, 100, 100);
+		drawList.flush(std::cout, &viewport);
+
+		b = new Browser(nullptr, 4);
+		b -> hintPages({"page2.html", "page3.html"});
+		for (auto &pageName : pageNames)
+			b -> drawPage(pageName);
+		delete b;
+
+		// images served in place from a memory-mapped pack, in a file of this
+		// run's own so that concurrent runs do not write over each other
+		char packTemplate[] = "/tmp/flyweight_test_XXXXXX.pack";
+		int packFd = mkstemps(packTemplate, 5);
+		if (packFd < 0) throw "Error!";
+		close(packFd);
+		std::string packPath = packTemplate;
+		AssetPackBuilder builder;
+		for (const char *imageName : {"img1.png", "img2.png", "img3.png", "img4.png", "img5.png", "img6.png"}) {
+			std::vector<unsigned char> pixels(256, (unsigned char)imageName[3]);
+			builder.add(imageName, pixels.data(), pixels.size());
+		}
+		builder.write(packPath);
+		b = new Browser(new Cache(new PackImageLoader(new AssetPack(packPath))));
+		b -> drawPage(pageNames[0]);
+		delete b;
+
+		// a flipped byte fails the checksum
+		std::fstream pack(packPath, std::ios::binary | std::ios::in | std::ios::out);
+		pack.seekp(sizeof(AssetPackHeader) + 10);
+		pack.put('X');
+		pack.close();
+		try {
+			AssetPack corrupt(packPath);
+		} catch (const char *) {
+			std::cout << "Corrupt pack rejected" << std::endl;
+		}
+		unlink(packPath.c_str());
+	}
+
+	// discards everything written to it
+	class NullBuffer : public std::streambuf {
+	protected:
+		virtual int overflow(int c) {
+			return c;
+		}
+		virtual std::streamsize xsputn(const char *, std::streamsize n) {
+			return n;
+		}
+	};
+
+	void BenchmarkSuite() {
+		std::vector<std::string> pageNames = {
+			"page1.html",
+			"page2.html",
+			"page3.html"
+		};
+		size_t imagesPerRound = 0;
+		for (auto &pageName : pageNames)
+			imagesPerRound += www.at(NameTable::getSI() -> find(pageName)).size();
+
+		const int rounds = 200000;
+		unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+		Browser *b = new Browser(new ConcurrentCache(new ImageLoader()));
+		NullBuffer warmBuffer;
+		std::ostream warmStream(&warmBuffer);
+		for (auto &pageName : pageNames)
+			b -> drawPage(pageName, warmStream);
+
+		std::cout << "ConcurrentCache hit throughput (" << rounds << " rounds per thread)" << std::endl;
+		double singleRate = 0;
+		for (unsigned threadsCount = 1; ; threadsCount = std::min(threadsCount * 2, maxThreads)) {
+			std::atomic<bool> go(false);
+			std::vector<std::thread> threads;
+			for (unsigned t = 0; t < threadsCount; ++t)
+				threads.emplace_back([&] {
+					NullBuffer buffer;
+					std::ostream os(&buffer);
+					DrawList drawList;
+					std::vector<NameID> pageIDs;
+					for (auto &pageName : pageNames)
+						pageIDs.push_back(NameTable::getSI() -> find(pageName));
+					while (!go.load(std::memory_order_acquire))
+						std::this_thread::yield();
+					for (int round = 0; round < rounds; ++round)
+						for (NameID pageID : pageIDs)
+							b -> drawPage(pageID, drawList, os);
+				});
+			auto start = std::chrono::steady_clock::now();
+			go.store(true, std::memory_order_release);
+			for (auto &thread : threads)
+				thread.join();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			double rate = threadsCount * rounds * imagesPerRound / elapsed.count();
+			if (threadsCount == 1)
+				singleRate = rate;
+			std::cout << "  threads : " << threadsCount << "  hits/s : " << (long long)rate;
+			std::cout << "  speedup : " << rate / singleRate << std::endl;
+			if (threadsCount == maxThreads)
+				break;
+		}
+		delete b;
 	}
 }
\ No newline at end of file
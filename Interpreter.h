@@ -1,21 +1,158 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef INTERPRETER_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+// every heap allocation of the program is counted, for the steady-state
+// check and the benchmarks, along with live and peak heap bytes
 namespace Interpreter {
-	typedef std::vector<const std::string> vcs;
+	std::atomic<size_t> allocationsCount(0);
+	std::atomic<size_t> liveBytes(0);
+	std::atomic<size_t> peakBytes(0);
+}
+void *operator new(size_t size) {
+	++Interpreter::allocationsCount;
+	void *memory = malloc(size);
+	if (!memory)
+		throw std::bad_alloc();
+	size_t live = Interpreter::liveBytes += malloc_usable_size(memory);
+	size_t peak = Interpreter::peakBytes;
+	while (live > peak && !Interpreter::peakBytes.compare_exchange_weak(peak, live))
+		;
+	return memory;
+}
+void operator delete(void *memory) noexcept {
+	if (memory)
+		Interpreter::liveBytes -= malloc_usable_size(memory);
+	free(memory);
+}
+void operator delete(void *memory, size_t) noexcept {
+	operator delete(memory);
+}
+#endif
+
+namespace Interpreter {
+	// the text is shared as a whole through shared_ptr<const vcs>
+	typedef std::vector<std::string> vcs;
+
+	// interned tokens shared by texts and pattern literals
+	typedef uint32_t Symbol;
+	// what a word that no pattern literal uses maps to, when looked up only
+	const Symbol noSymbol = UINT32_MAX;
+
+	class SymbolTable {
+		// indexed by symbol; the keys of symbols are views of these strings,
+		// which appending to a deque leaves where they are
+		std::deque<std::string> names;
+		std::unordered_map<std::string_view, Symbol> symbols;
+		mutable std::shared_mutex mutex;
+
+		Symbol internLocked(std::string_view name) {
+			auto it = symbols.find(name);
+			if (it != symbols.end())
+				return it -> second;
+			Symbol symbol = (Symbol)names.size();
+			names.emplace_back(name);
+			symbols.emplace(names.back(), symbol);
+			return symbol;
+		}
+	public:
+		static SymbolTable *getSI() {
+			static SymbolTable sharedInstance;
+			return &sharedInstance;
+		}
+		Symbol intern(std::string_view name) {
+			{
+				std::shared_lock<std::shared_mutex> lock(mutex);
+				auto it = symbols.find(name);
+				if (it != symbols.end())
+					return it -> second;
+			}
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			return internLocked(name);
+		}
+		// one shared lock for a whole text, and an exclusive one only when
+		// some of its words are new
+		std::vector<Symbol> tokenize(const vcs &text) {
+			std::vector<Symbol> tokens = lookup(text);
+			if (std::find(tokens.begin(), tokens.end(), noSymbol) == tokens.end())
+				return tokens;
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			for (size_t idx = 0; idx < text.size(); ++idx)
+				if (tokens[idx] == noSymbol)
+					tokens[idx] = internLocked(text[idx]);
+			return tokens;
+		}
+		// never adds to the table: a word it does not hold cannot match any
+		// literal, those intern theirs when they are built
+		std::vector<Symbol> lookup(const vcs &words) const {
+			std::vector<Symbol> tokens;
+			tokens.reserve(words.size());
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			for (auto &word : words) {
+				auto it = symbols.find(word);
+				tokens.push_back(it != symbols.end() ? it -> second : noSymbol);
+			}
+			return tokens;
+		}
+		const std::string &name(Symbol symbol) const {
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			return names.at(symbol);
+		}
+	};
 
 	class Context {
 		std::shared_ptr<const vcs> pText;
+		// pre-tokenized form, the only one the matchers read
+		std::shared_ptr<const std::vector<Symbol>> pTokens;
 		std::vector<std::pair<int, int>> result;
 	public:
 		Context(std::shared_ptr<const vcs> apText) : pText(apText) {
+			pTokens = std::make_shared<const std::vector<Symbol>>(SymbolTable::getSI() -> tokenize(*pText));
 		}
+		Context(std::shared_ptr<const std::vector<Symbol>> apTokens) : pTokens(apTokens) {
+		}
+		// only available when the context was built from text
 		const vcs &text() const {
+			if (!pText) throw "Error!";
 			return *pText;
 		}
+		const std::vector<Symbol> &tokens() const {
+			return *pTokens;
+		}
+		const std::vector<std::pair<int, int>> &matches() const {
+			return result;
+		}
+		// keeps the capacity, so matching again does not reallocate
+		void clearMatches() {
+			result.clear();
+		}
 		friend class RegexPattern;
 		friend std::ostream &operator<<(std::ostream &os, const Context &ctx);
 	};
@@ -26,19 +163,176 @@ namespace Interpreter {
 			if (beginIdx > endIdx - 1)
 				continue;
 
-			std::cout << "[" + std::to_string(beginIdx);
+			os << '[' << beginIdx;
 			if (beginIdx < endIdx - 1)
-				std::cout << ", " + std::to_string(endIdx - 1);
-			std::cout << "] : ";
+				os << ", " << endIdx - 1;
+			os << "] : ";
 
-			std::cout << "[...";
+			os << "[...";
 			for (int idx = beginIdx; idx < endIdx; ++idx)
-				 std::cout << ", " << ctx.text()[idx];
-			std::cout << ", ...]" << std::endl;
+				os << ", " << SymbolTable::getSI() -> name(ctx.tokens()[idx]);
+			os << ", ...]\n";
 		}
 		return os;
 	}
 
+	// index of the first occurrence of symbol in tokens[from, count), or count
+	size_t findSymbol(const Symbol *tokens, size_t from, size_t count, Symbol symbol) {
+		size_t idx = from;
+#ifdef __SSE2__
+		// 16 tokens per step, the scalar loop below pins down the hit
+		__m128i needle = _mm_set1_epi32((int)symbol);
+		for (; idx + 16 <= count; idx += 16) {
+			const __m128i *block = (const __m128i *)(tokens + idx);
+			__m128i hits = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block), needle), _mm_cmpeq_epi32(_mm_loadu_si128(block + 1), needle)),
+				_mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block + 2), needle), _mm_cmpeq_epi32(_mm_loadu_si128(block + 3), needle)));
+			if (_mm_movemask_epi8(hits))
+				break;
+		}
+#endif
+		while (idx < count && tokens[idx] != symbol)
+			++idx;
+		return idx;
+	}
+
+	// compiled form: Thompson NFA over symbols
+	class Program {
+	public:
+		enum Kind {
+			Literal,
+			Split,
+			Match
+		};
+		struct State {
+			Kind kind;
+			Symbol symbol;
+			int out;
+			int out1;
+		};
+		std::vector<State> states;
+		int start = 0;
+		// symbol -> DFA input class, 0 for every token no literal mentions
+		std::vector<int> classes;
+		int classesCount = 1;
+		// whether the empty sequence matches and which symbols can begin a match
+		bool nullable = false;
+		std::vector<Symbol> firstSymbols;
+
+		Program() {
+			states.push_back({Match, 0, -1, -1});
+		}
+		int addState(Kind kind, Symbol symbol, int out, int out1 = -1) {
+			states.push_back({kind, symbol, out, out1});
+			return (int)states.size() - 1;
+		}
+		int addLiteral(Symbol symbol, int next) {
+			if (symbol >= classes.size())
+				classes.resize(symbol + 1, 0);
+			if (!classes[symbol])
+				classes[symbol] = classesCount++;
+			return addState(Literal, symbol, next);
+		}
+		int classOf(Symbol symbol) const {
+			return symbol < classes.size() ? classes[symbol] : 0;
+		}
+		// fills nullable and firstSymbols from the closure of the start state
+		void finalize() {
+			std::vector<bool> seen(states.size(), false);
+			std::vector<int> stack = {start};
+			while (!stack.empty()) {
+				int s = stack.back();
+				stack.pop_back();
+				if (seen[s])
+					continue;
+				seen[s] = true;
+				const State &st = states[s];
+				if (st.kind == Match)
+					nullable = true;
+				else if (st.kind == Literal)
+					firstSymbols.push_back(st.symbol);
+				else {
+					stack.push_back(st.out);
+					stack.push_back(st.out1);
+				}
+			}
+			std::sort(firstSymbols.begin(), firstSymbols.end());
+			firstSymbols.erase(std::unique(firstSymbols.begin(), firstSymbols.end()), firstSymbols.end());
+		}
+		bool canStart(Symbol symbol) const {
+			return nullable || std::binary_search(firstSymbols.begin(), firstSymbols.end(), symbol);
+		}
+		// next start position worth trying at or after beginIdx
+		int nextStart(const std::vector<Symbol> &tokens, int beginIdx) const {
+			if (nullable)
+				return beginIdx;
+			if (firstSymbols.size() == 1)
+				return (int)findSymbol(tokens.data(), beginIdx, tokens.size(), firstSymbols[0]);
+			while (beginIdx < (int)tokens.size() && !canStart(tokens[beginIdx]))
+				++beginIdx;
+			return beginIdx;
+		}
+	};
+
+	// monotonic allocator: bumps through its blocks and frees nothing until
+	// reset, which rewinds to the first block and keeps them all for reuse
+	class Arena : public std::pmr::memory_resource {
+		struct Block {
+			char *data;
+			size_t size;
+		};
+		std::pmr::memory_resource *upstream;
+		std::vector<Block> blocks;
+		size_t current = 0;
+		size_t offset = 0;
+		size_t firstBlockSize;
+
+		virtual void *do_allocate(size_t bytes, size_t alignment) {
+			while (current < blocks.size()) {
+				Block &block = blocks[current];
+				size_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+				if (aligned + bytes <= block.size) {
+					offset = aligned + bytes;
+					return block.data + aligned;
+				}
+				++current;
+				offset = 0;
+			}
+			size_t size = std::max(blocks.empty() ? firstBlockSize : 2 * blocks.back().size, bytes + alignment);
+			blocks.push_back({(char *)upstream -> allocate(size, alignof(std::max_align_t)), size});
+			current = blocks.size() - 1;
+			offset = 0;
+			return do_allocate(bytes, alignment);
+		}
+		virtual void do_deallocate(void *, size_t, size_t) {
+		}
+		virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+			return this == &other;
+		}
+	public:
+		Arena(size_t aFirstBlockSize = 4096, std::pmr::memory_resource *anUpstream = std::pmr::new_delete_resource()) : upstream(anUpstream), firstBlockSize(aFirstBlockSize) {
+		}
+		Arena(const Arena &) = delete;
+		Arena &operator=(const Arena &) = delete;
+		virtual ~Arena() {
+			for (auto &block : blocks)
+				upstream -> deallocate(block.data, block.size, alignof(std::max_align_t));
+		}
+		void reset() {
+			current = 0;
+			offset = 0;
+		}
+		size_t capacity() const {
+			size_t total = 0;
+			for (auto &block : blocks)
+				total += block.size;
+			return total;
+		}
+	};
+
+	// end positions of an interpretation, allocated from the matcher's scratch arena
+	typedef std::pmr::vector<int> Ends;
+
 	// abstract expressions
 	class Expression {
 	public:
@@ -46,8 +340,22 @@ namespace Interpreter {
 		}
 		virtual ~Expression() {
 		}
-		virtual std::vector<int> interpret(Context &ctx, int idx) = 0;
+		virtual Ends interpret(Context &ctx, int idx, std::pmr::memory_resource *scratch) const = 0;
+		// emits the states of this expression continuing to next, returns the entry state
+		virtual int compile(Program &program, int next) const = 0;
+	};
+	// nodes placed in an arena are only destroyed, their memory goes with the arena
+	struct ExpressionDeleter {
+		bool inArena = false;
+
+		void operator()(Expression *expression) const {
+			if (inArena)
+				expression -> ~Expression();
+			else
+				delete expression;
+		}
 	};
+	typedef std::unique_ptr<Expression, ExpressionDeleter> ExpressionPtr;
 	class TerminalExpression : public Expression {
 	public:
 		TerminalExpression() : Expression() {
@@ -66,34 +374,40 @@ namespace Interpreter {
 	// concrete terminal expressions
 	class Literal : public TerminalExpression {
 		std::string lit;
+		// resolved once, matching compares integers
+		Symbol symbol;
 	public:
-		Literal(std::string aLit) : TerminalExpression(), lit(aLit) {
+		Literal(std::string aLit) : TerminalExpression(), lit(aLit), symbol(SymbolTable::getSI() -> intern(aLit)) {
 		}
 		virtual ~Literal() {
 		}
-		virtual std::vector<int> interpret(Context &ctx, int idx) {
-			if (idx >= ctx.text().size() || lit != ctx.text()[idx])
-				return {};
-			return {idx + 1};
+		virtual Ends interpret(Context &ctx, int idx, std::pmr::memory_resource *scratch) const {
+			Ends literalMatch(scratch);
+			if (idx < ctx.tokens().size() && symbol == ctx.tokens()[idx])
+				literalMatch.push_back(idx + 1);
+			return literalMatch;
+		}
+		virtual int compile(Program &program, int next) const {
+			return program.addLiteral(symbol, next);
 		}
 	};
 
 	// non-terminal expressions
 	class BinaryExpression : public NonTerminalExpression {
 	protected:
-		std::unique_ptr<Expression> left;
-		std::unique_ptr<Expression> right;
+		ExpressionPtr left;
+		ExpressionPtr right;
 	public:
-		BinaryExpression(std::unique_ptr<Expression> &aLeft, std::unique_ptr<Expression> &aRight) : NonTerminalExpression(), left(std::move(aLeft)), right(std::move(aRight)) {
+		BinaryExpression(ExpressionPtr &aLeft, ExpressionPtr &aRight) : NonTerminalExpression(), left(std::move(aLeft)), right(std::move(aRight)) {
 		}
 		virtual ~BinaryExpression() {
 		}
 	};
 	class UnaryExpression : public NonTerminalExpression {
 	protected:
-		std::unique_ptr<Expression> next;
+		ExpressionPtr next;
 	public:
-		UnaryExpression(std::unique_ptr<Expression> &aNext) : NonTerminalExpression(), next(std::move(aNext)) {
+		UnaryExpression(ExpressionPtr &aNext) : NonTerminalExpression(), next(std::move(aNext)) {
 		}
 		virtual ~UnaryExpression() {
 		}
@@ -102,86 +416,1002 @@ namespace Interpreter {
 	// concrete non-terminal expressions
 	class And : public BinaryExpression {
 	public:
-		And(std::unique_ptr<Expression> &aLeft, std::unique_ptr<Expression> &aRight) : BinaryExpression(aLeft, aRight) {
+		And(ExpressionPtr &aLeft, ExpressionPtr &aRight) : BinaryExpression(aLeft, aRight) {
 		}
 		virtual ~And() {
 		}
-		virtual std::vector<int> interpret(Context &ctx, int idx) {
-			std::vector<int> andMatch;
-			std::vector<int> leftMatch = left -> interpret(ctx, idx);
+		virtual Ends interpret(Context &ctx, int idx, std::pmr::memory_resource *scratch) const {
+			Ends andMatch(scratch);
+			Ends leftMatch = left -> interpret(ctx, idx, scratch);
 			if (leftMatch.empty()) 
 				return andMatch;
 			for (int iidx : leftMatch) {
-				std::vector<int> rightMatch = right -> interpret(ctx, iidx);
+				Ends rightMatch = right -> interpret(ctx, iidx, scratch);
 				andMatch.insert(andMatch.end(), rightMatch.begin(), rightMatch.end());
 			}
 			return andMatch;
 		}
+		virtual int compile(Program &program, int next) const {
+			return left -> compile(program, right -> compile(program, next));
+		}
 	};
 	class Or : public BinaryExpression {
 	public:
-		Or(std::unique_ptr<Expression> &aLeft, std::unique_ptr<Expression> &aRight) : BinaryExpression(aLeft, aRight) {
+		Or(ExpressionPtr &aLeft, ExpressionPtr &aRight) : BinaryExpression(aLeft, aRight) {
 		}
 		virtual ~Or() {
 		}
-		virtual std::vector<int> interpret(Context &ctx, int idx) {
-			std::vector<int> orMatch;
-			std::vector<int> leftMatch = left -> interpret(ctx, idx);
+		virtual Ends interpret(Context &ctx, int idx, std::pmr::memory_resource *scratch) const {
+			Ends orMatch(scratch);
+			Ends leftMatch = left -> interpret(ctx, idx, scratch);
 			orMatch.insert(orMatch.end(), leftMatch.begin(), leftMatch.end());
-			std::vector<int> rightMatch = right -> interpret(ctx, idx);
+			Ends rightMatch = right -> interpret(ctx, idx, scratch);
 			orMatch.insert(orMatch.end(), rightMatch.begin(), rightMatch.end());
 			return orMatch;
 		}
+		virtual int compile(Program &program, int next) const {
+			int leftStart = left -> compile(program, next);
+			int rightStart = right -> compile(program, next);
+			return program.addState(Program::Split, 0, leftStart, rightStart);
+		}
 	};
 	class ZeroOrMany : public UnaryExpression {
 	public:
-		ZeroOrMany(std::unique_ptr<Expression> &aNext) : UnaryExpression(aNext) {
+		ZeroOrMany(ExpressionPtr &aNext) : UnaryExpression(aNext) {
 		}
 		virtual ~ZeroOrMany() {
 		}
-		virtual std::vector<int> interpret(Context &ctx, int idx) {
-			std::vector<int> zeroOrManyMatch = {idx};
-			std::vector<int> nextMatch = {idx};
+		virtual Ends interpret(Context &ctx, int idx, std::pmr::memory_resource *scratch) const {
+			Ends zeroOrManyMatch({idx}, scratch);
+			Ends nextMatch({idx}, scratch);
+			Ends tmp(scratch);
 			do {
-				std::vector<int> tmp = nextMatch; 
+				// swap instead of copy, a copy would leave the arena
+				tmp.swap(nextMatch);
 				nextMatch.clear();
 				for (int iidx : tmp) {
-					std::vector<int> match = next -> interpret(ctx, iidx);
-					nextMatch.insert(nextMatch.end(), match.begin(), match.end());
+					Ends match = next -> interpret(ctx, iidx, scratch);
+					// only ends not reached before go round again, a body
+					// that matches empty would otherwise loop forever
+					for (int end : match)
+						if (std::find(zeroOrManyMatch.begin(), zeroOrManyMatch.end(), end) == zeroOrManyMatch.end()) {
+							zeroOrManyMatch.push_back(end);
+							nextMatch.push_back(end);
+						}
 				}
-				zeroOrManyMatch.insert(zeroOrManyMatch.end(), nextMatch.begin(), nextMatch.end());
 			} while (!nextMatch.empty());
 			return zeroOrManyMatch;
 		}
+		virtual int compile(Program &program, int next) const {
+			// the loop state is patched once the body knows where it starts
+			int loop = program.addState(Program::Split, 0, -1, next);
+			program.states[loop].out = this -> next -> compile(program, loop);
+			return loop;
+		}
+	};
+
+	// parser: precedence climbing over "*" > "&" > "|", parentheses group
+	class Parser {
+		const std::string &pattern;
+		size_t pos = 0;
+		// nodes go to the heap when there is no arena
+		Arena *arena;
+
+		template <class T, class... Args>
+		ExpressionPtr make(Args &&... args) {
+			if (!arena)
+				return ExpressionPtr(new T(std::forward<Args>(args)...));
+			void *memory = arena -> allocate(sizeof(T), alignof(T));
+			return ExpressionPtr(new (memory) T(std::forward<Args>(args)...), ExpressionDeleter{true});
+		}
+
+		void skipSpaces() {
+			while (pos < pattern.size() && isspace((unsigned char)pattern[pos]))
+				++pos;
+		}
+		static bool isOperator(char c) {
+			return c == '&' || c == '|' || c == '*' || c == '(' || c == ')';
+		}
+		static int precedence(char op) {
+			switch (op) {
+			case '|':
+				return 1;
+			case '&':
+				return 2;
+			default:
+				return 0;
+			}
+		}
+		char peek() {
+			skipSpaces();
+			return pos < pattern.size() ? pattern[pos] : '\0';
+		}
+		ExpressionPtr parsePrimary() {
+			char c = peek();
+			if (c == '(') {
+				++pos;
+				ExpressionPtr inner = parseExpression(1);
+				if (peek() != ')') throw "Error!";
+				++pos;
+				return inner;
+			}
+			size_t begin = pos;
+			while (pos < pattern.size() && !isOperator(pattern[pos]) && !isspace((unsigned char)pattern[pos]))
+				++pos;
+			if (pos == begin) throw "Error!";
+			return make<Literal>(pattern.substr(begin, pos - begin));
+		}
+		ExpressionPtr parseUnary() {
+			ExpressionPtr operand = parsePrimary();
+			while (peek() == '*') {
+				++pos;
+				operand = make<ZeroOrMany>(operand);
+			}
+			return operand;
+		}
+		ExpressionPtr parseExpression(int minPrecedence) {
+			ExpressionPtr lhs = parseUnary();
+			for (;;) {
+				char op = peek();
+				int prec = precedence(op);
+				if (!prec || prec < minPrecedence)
+					return lhs;
+				++pos;
+				// left associative: the right side only takes tighter operators
+				ExpressionPtr rhs = parseExpression(prec + 1);
+				if (op == '&')
+					lhs = make<And>(lhs, rhs);
+				else
+					lhs = make<Or>(lhs, rhs);
+			}
+		}
+		Parser(const std::string &aPattern, Arena *anArena) : pattern(aPattern), arena(anArena) {
+		}
+	public:
+		static ExpressionPtr parse(const std::string &pattern, Arena *arena = nullptr) {
+			Parser parser(pattern, arena);
+			ExpressionPtr root = parser.parseExpression(1);
+			if (parser.peek() != '\0') throw "Error!";
+			return root;
+		}
+	};
+
+	// immutable parse and compile result, shared by every user of the pattern
+	class CompiledPattern {
+		// declared first so the nodes are destroyed before their memory
+		Arena nodes;
+	public:
+		ExpressionPtr root;
+		Program program;
+
+		CompiledPattern(const std::string &pattern) : nodes(1024), root(Parser::parse(pattern, &nodes)) {
+			program.start = root -> compile(program, 0);
+			program.finalize();
+		}
+	};
+
+	// process-wide LRU cache of compiled patterns keyed by pattern text
+	class PatternCache {
+		typedef std::pair<std::string, std::shared_ptr<const CompiledPattern>> Entry;
+		std::list<Entry> entries;
+		std::unordered_map<std::string, std::list<Entry>::iterator> positions;
+		size_t capacity;
+		std::mutex mutex;
+
+		PatternCache(size_t aCapacity) : capacity(aCapacity) {
+		}
+	public:
+		static PatternCache *getSI() {
+			static PatternCache sharedInstance(512);
+			return &sharedInstance;
+		}
+		std::shared_ptr<const CompiledPattern> get(const std::string &pattern) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto it = positions.find(pattern);
+				if (it != positions.end()) {
+					entries.splice(entries.begin(), entries, it -> second);
+					return it -> second -> second;
+				}
+			}
+			// compile outside the lock, a concurrent compile of the same text loses
+			std::shared_ptr<const CompiledPattern> compiled = std::make_shared<const CompiledPattern>(pattern);
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = positions.find(pattern);
+			if (it != positions.end())
+				return it -> second -> second;
+			entries.emplace_front(pattern, compiled);
+			positions[pattern] = entries.begin();
+			while (entries.size() > capacity) {
+				positions.erase(entries.back().first);
+				entries.pop_back();
+			}
+			return compiled;
+		}
+		void setCapacity(size_t aCapacity) {
+			std::lock_guard<std::mutex> lock(mutex);
+			capacity = aCapacity;
+			while (entries.size() > capacity) {
+				positions.erase(entries.back().first);
+				entries.pop_back();
+			}
+		}
+		size_t size() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return entries.size();
+		}
+	};
+
+	// set of NFA states with O(1) insert and clear
+	class SparseSet {
+		std::vector<int> dense;
+		std::vector<int> sparse;
+		int count = 0;
+	public:
+		SparseSet(int capacity) : dense(capacity), sparse(capacity) {
+		}
+		bool insert(int value) {
+			if (contains(value))
+				return false;
+			sparse[value] = count;
+			dense[count++] = value;
+			return true;
+		}
+		bool contains(int value) const {
+			int idx = sparse[value];
+			return idx < count && dense[idx] == value;
+		}
+		void clear() {
+			count = 0;
+		}
+		int size() const {
+			return count;
+		}
+		const int *begin() const {
+			return dense.data();
+		}
+		const int *end() const {
+			return dense.data() + count;
+		}
+	};
+
+	// simulates the NFA from one start position at a time
+	class NfaMatcher {
+		const Program &program;
+		SparseSet current, next;
+		std::vector<int> stack;
+
+		void addClosure(SparseSet &set, int state) {
+			int top = 0;
+			stack[top++] = state;
+			while (top) {
+				int s = stack[--top];
+				if (!set.insert(s))
+					continue;
+				const Program::State &st = program.states[s];
+				if (st.kind == Program::Split) {
+					stack[top++] = st.out1;
+					stack[top++] = st.out;
+				}
+			}
+		}
+		bool accepts(const SparseSet &set) const {
+			return set.contains(0);
+		}
+	public:
+		NfaMatcher(const Program &aProgram) : program(aProgram), current(aProgram.states.size()), next(aProgram.states.size()), stack(2 * aProgram.states.size() + 1) {
+		}
+		// appends the ends of the matches from beginIdx in ascending order
+		void matchAt(const std::vector<Symbol> &tokens, int beginIdx, std::vector<int> &ends, bool firstOnly = false) {
+			current.clear();
+			addClosure(current, program.start);
+			if (accepts(current)) {
+				ends.push_back(beginIdx);
+				if (firstOnly)
+					return;
+			}
+			for (int idx = beginIdx; idx < (int)tokens.size() && current.size(); ++idx) {
+				next.clear();
+				for (int s : current) {
+					const Program::State &st = program.states[s];
+					if (st.kind == Program::Literal && st.symbol == tokens[idx])
+						addClosure(next, st.out);
+				}
+				std::swap(current, next);
+				if (accepts(current)) {
+					ends.push_back(idx + 1);
+					if (firstOnly)
+						return;
+				}
+			}
+		}
+	};
+
+	// subset construction on demand, one DFA state per distinct NFA state set
+	class LazyDfa {
+		const Program &program;
+		int classesCount;
+		std::vector<std::vector<int>> stateSets;
+		std::vector<bool> accepting;
+		// stateSets.size() x symbolsCount, -1 when not built yet
+		std::vector<int> transitions;
+		std::map<std::vector<int>, int> ids;
+		SparseSet scratch;
+		std::vector<int> stack;
+		size_t maxStates;
+
+		void addClosure(int state) {
+			int top = 0;
+			stack[top++] = state;
+			while (top) {
+				int s = stack[--top];
+				if (!scratch.insert(s))
+					continue;
+				const Program::State &st = program.states[s];
+				if (st.kind == Program::Split) {
+					stack[top++] = st.out1;
+					stack[top++] = st.out;
+				}
+			}
+		}
+		int stateFor() {
+			std::vector<int> set(scratch.begin(), scratch.end());
+			std::sort(set.begin(), set.end());
+			auto it = ids.find(set);
+			if (it != ids.end())
+				return it -> second;
+			if (stateSets.size() >= maxStates)
+				return -1;
+			int id = (int)stateSets.size();
+			accepting.push_back(std::binary_search(set.begin(), set.end(), 0));
+			ids.emplace(set, id);
+			stateSets.push_back(std::move(set));
+			transitions.resize(transitions.size() + classesCount, -1);
+			return id;
+		}
+	public:
+		int start;
+
+		LazyDfa(const Program &aProgram, size_t aMaxStates = 4096) : program(aProgram), classesCount(aProgram.classesCount), scratch(aProgram.states.size()), stack(2 * aProgram.states.size() + 1), maxStates(aMaxStates) {
+			scratch.clear();
+			addClosure(program.start);
+			start = stateFor();
+		}
+		bool isAccepting(int state) const {
+			return accepting[state];
+		}
+		bool isDead(int state) const {
+			return stateSets[state].empty();
+		}
+		// -1 when the state budget is exhausted
+		int step(int state, int inputClass) {
+			int target = transitions[state * classesCount + inputClass];
+			if (target >= 0)
+				return target;
+			scratch.clear();
+			for (int s : stateSets[state]) {
+				const Program::State &st = program.states[s];
+				if (st.kind == Program::Literal && program.classOf(st.symbol) == inputClass)
+					addClosure(st.out);
+			}
+			int id = stateFor();
+			// stateFor may have grown transitions, so index again
+			if (id >= 0)
+				transitions[state * classesCount + inputClass] = id;
+			return id;
+		}
+		// false when the DFA gave up and the caller must fall back to the NFA
+		bool matchAt(const std::vector<Symbol> &tokens, int beginIdx, std::vector<int> &ends, bool firstOnly = false) {
+			size_t mark = ends.size();
+			int state = start;
+			if (isAccepting(state)) {
+				ends.push_back(beginIdx);
+				if (firstOnly)
+					return true;
+			}
+			for (int idx = beginIdx; idx < (int)tokens.size() && !isDead(state); ++idx) {
+				state = step(state, program.classOf(tokens[idx]));
+				if (state < 0) {
+					ends.resize(mark);
+					return false;
+				}
+				if (isAccepting(state)) {
+					ends.push_back(idx + 1);
+					if (firstOnly)
+						return true;
+				}
+			}
+			return true;
+		}
+	};
+
+	// Pike VM over an unbounded token stream; only the active state set and
+	// one begin position per state survive between chunks, so memory is
+	// bounded by the pattern. Threads are kept in begin order and the first
+	// one to reach a state wins, so every non-empty match end is reported
+	// once, with its leftmost begin, as soon as the token completing it arrives
+	class StreamMatcher {
+	public:
+		typedef std::function<void(long long beginIdx, long long endIdx)> MatchCallback;
+	private:
+		std::shared_ptr<const CompiledPattern> compiled;
+		const Program &program;
+		MatchCallback onMatch;
+		SparseSet current, next;
+		std::vector<long long> currentBegins, nextBegins;
+		std::vector<int> stack;
+		long long position = 0;
+
+		void addClosure(SparseSet &set, std::vector<long long> &begins, int state, long long beginIdx) {
+			int top = 0;
+			stack[top++] = state;
+			while (top) {
+				int s = stack[--top];
+				if (!set.insert(s))
+					continue;
+				begins[s] = beginIdx;
+				const Program::State &st = program.states[s];
+				if (st.kind == Program::Split) {
+					stack[top++] = st.out1;
+					stack[top++] = st.out;
+				}
+			}
+		}
+	public:
+		StreamMatcher(std::shared_ptr<const CompiledPattern> aCompiled, MatchCallback anOnMatch) : compiled(aCompiled), program(aCompiled -> program), onMatch(anOnMatch), current(program.states.size()), next(program.states.size()), currentBegins(program.states.size()), nextBegins(program.states.size()), stack(2 * program.states.size() + 1) {
+			current.clear();
+			next.clear();
+		}
+		void feed(const Symbol *tokens, size_t count) {
+			for (size_t idx = 0; idx < count; ++idx, ++position) {
+				Symbol token = tokens[idx];
+				// a match may begin here, behind every older thread
+				if (program.canStart(token))
+					addClosure(current, currentBegins, program.start, position);
+				if (!current.size())
+					continue;
+				next.clear();
+				for (int s : current) {
+					const Program::State &st = program.states[s];
+					if (st.kind == Program::Literal && st.symbol == token)
+						addClosure(next, nextBegins, st.out, currentBegins[s]);
+				}
+				std::swap(current, next);
+				std::swap(currentBegins, nextBegins);
+				if (current.contains(0))
+					onMatch(currentBegins[0], position + 1);
+			}
+		}
+		void feed(const std::vector<Symbol> &tokens) {
+			feed(tokens.data(), tokens.size());
+		}
+		// an unbounded stream must not grow the symbol table
+		void feed(const vcs &words) {
+			feed(SymbolTable::getSI() -> lookup(words));
+		}
+		// tokens consumed so far, the index the next token gets
+		long long consumed() const {
+			return position;
+		}
+		void reset() {
+			current.clear();
+			position = 0;
+		}
+	};
+
+	// chunks dealt round-robin to per-worker deques; a worker pops its own
+	// newest chunk and, when out of work, steals the oldest from the others
+	class ChunkScheduler {
+		struct alignas(64) Queue {
+			std::mutex mutex;
+			std::deque<int> chunks;
+		};
+		std::vector<Queue> queues;
+	public:
+		ChunkScheduler(int workersCount, int chunksCount) : queues(workersCount) {
+			for (int chunk = chunksCount - 1; chunk >= 0; --chunk)
+				queues[chunk % workersCount].chunks.push_back(chunk);
+		}
+		bool next(int worker, int &chunk) {
+			int workersCount = (int)queues.size();
+			for (int offset = 0; offset < workersCount; ++offset) {
+				Queue &queue = queues[(worker + offset) % workersCount];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (queue.chunks.empty())
+					continue;
+				if (!offset) {
+					chunk = queue.chunks.back();
+					queue.chunks.pop_back();
+				} else {
+					chunk = queue.chunks.front();
+					queue.chunks.pop_front();
+				}
+				return true;
+			}
+			return false;
+		}
 	};
 
 	// interpreter
 	class RegexPattern {
-		std::unique_ptr<Expression> root;
 	public:
-		RegexPattern(std::string pattern) {
-			// TODO: parse pattern ...
-			// "raining*&((cats&dogs)|cats)*"
-			std::unique_ptr<Expression> lit1(new Literal("raining"));
-			std::unique_ptr<Expression> lit2(new Literal("cats"));
-			std::unique_ptr<Expression> lit3(new Literal("dogs"));
-			std::unique_ptr<Expression> lit4(new Literal("cats"));
+		// the tree-walking interpreter stays as the reference for differential testing
+		enum Engine {
+			Reference,
+			NFA,
+			DFA
+		};
+		// invoked for every match, returning false stops the search
+		typedef std::function<bool(int beginIdx, int endIdx)> MatchVisitor;
+	private:
+		// per-thread matching state, reused by every match; the lazy DFA
+		// grows while matching, so each pattern object owns one
+		struct Matchers {
+			LazyDfa dfa;
+			NfaMatcher nfa;
+			Arena scratch;
+			std::vector<int> ends;
+
+			Matchers(const Program &program) : dfa(program), nfa(program) {
+			}
+		};
+		enum Mode {
+			AllMatches,
+			ExistsOnly,
+			CountOnly,
+			LeftmostLongest,
+			Visit
+		};
+		// where the matches of one scan go
+		struct Sink {
+			Mode mode;
+			std::vector<std::pair<int, int>> *result;
+			const MatchVisitor *visitor;
+			size_t count = 0;
+			bool stopped = false;
+
+			Sink(Mode aMode, std::vector<std::pair<int, int>> *aResult = nullptr, const MatchVisitor *aVisitor = nullptr) : mode(aMode), result(aResult), visitor(aVisitor) {
+			}
+		};
+		// threads of matchParallel, kept from call to call along with matchers
+		// of their own, so each worker's lazy DFA stays warm for the next call
+		class WorkerPool {
+			struct Job {
+				RegexPattern *pattern;
+				Context *ctx;
+				int chunkSize;
+				int tokensCount;
+				unsigned workersCount;
+				ChunkScheduler *scheduler;
+				std::vector<std::vector<std::pair<int, int>>> *chunkResults;
+			};
+			std::vector<std::unique_ptr<Matchers>> workerMatchers;
+			std::vector<std::thread> workers;
+			std::mutex mutex;
+			std::condition_variable jobCondition;
+			std::condition_variable doneCondition;
+			Job job = {};
+			uint64_t generation = 0;
+			unsigned pending = 0;
+			bool stopping = false;
 
-			std::unique_ptr<Expression> zeroOrMany1(new ZeroOrMany(lit1));
-			std::unique_ptr<Expression> and1(new And(lit2, lit3));
-			std::unique_ptr<Expression> or1(new Or(and1, lit4));
-			std::unique_ptr<Expression> zeroOrMany2(new ZeroOrMany(or1));
+			void work(unsigned worker) {
+				uint64_t seen = 0;
+				for (;;) {
+					Job current;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						jobCondition.wait(lock, [this, seen] {
+							return stopping || generation != seen;
+						});
+						if (stopping)
+							return;
+						seen = generation;
+						current = job;
+					}
+					// workers past those the job asked for sit this one out
+					if (worker >= current.workersCount)
+						continue;
+					int chunk;
+					while (current.scheduler -> next(worker, chunk)) {
+						int fromIdx = chunk * current.chunkSize;
+						Sink sink(AllMatches, &(*current.chunkResults)[chunk]);
+						current.pattern -> matchRange(*current.ctx, fromIdx, std::min(fromIdx + current.chunkSize, current.tokensCount), *workerMatchers[worker], sink);
+					}
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!--pending)
+						doneCondition.notify_one();
+				}
+			}
+		public:
+			WorkerPool(const Program &program, unsigned workersCount) {
+				for (unsigned worker = 0; worker < workersCount; ++worker)
+					workerMatchers.emplace_back(new Matchers(program));
+				for (unsigned worker = 0; worker < workersCount; ++worker)
+					workers.emplace_back(&WorkerPool::work, this, worker);
+			}
+			WorkerPool(const WorkerPool &) = delete;
+			WorkerPool &operator=(const WorkerPool &) = delete;
+			~WorkerPool() {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stopping = true;
+				}
+				jobCondition.notify_all();
+				for (auto &worker : workers)
+					worker.join();
+			}
+			unsigned size() const {
+				return (unsigned)workers.size();
+			}
+			// returns once every chunk of the job is matched
+			void run(const Job &aJob) {
+				std::unique_lock<std::mutex> lock(mutex);
+				job = aJob;
+				pending = aJob.workersCount;
+				++generation;
+				jobCondition.notify_all();
+				doneCondition.wait(lock, [this] {
+					return !pending;
+				});
+			}
+		};
 
-			std::unique_ptr<Expression> and2(new And(zeroOrMany1, zeroOrMany2));
-			root = std::move(and2);
+		std::shared_ptr<const CompiledPattern> compiled;
+		std::unique_ptr<Matchers> matchers;
+		std::unique_ptr<WorkerPool> pool;
+		Engine engine;
+	public:
+		// e.g. "raining*&((cats&dogs)|cats)*"
+		RegexPattern(std::string pattern, Engine anEngine = DFA) : engine(anEngine) {
+			compiled = PatternCache::getSI() -> get(pattern);
+			matchers.reset(new Matchers(compiled -> program));
+		}
+		void setEngine(Engine anEngine) {
+			engine = anEngine;
 		}
+		StreamMatcher stream(StreamMatcher::MatchCallback onMatch) const {
+			return StreamMatcher(compiled, onMatch);
+		}
+	private:
+		// matches of every start position in [fromIdx, toIdx), appended to result
+		// takes the ends found from beginIdx, returns the next start position to try
+		static int collect(Sink &sink, int beginIdx, const int *ends, size_t endsCount) {
+			switch (sink.mode) {
+			case AllMatches:
+				for (size_t idx = 0; idx < endsCount; ++idx)
+					sink.result -> push_back({beginIdx, ends[idx]});
+				break;
+			case ExistsOnly:
+				if (endsCount) {
+					sink.count = 1;
+					sink.stopped = true;
+				}
+				break;
+			case CountOnly:
+				sink.count += endsCount;
+				break;
+			case LeftmostLongest: {
+				int longest = endsCount ? *std::max_element(ends, ends + endsCount) : beginIdx;
+				// empty matches are skipped, they would not advance the scan
+				if (longest > beginIdx) {
+					sink.result -> push_back({beginIdx, longest});
+					return longest;
+				}
+				break;
+			}
+			case Visit:
+				for (size_t idx = 0; idx < endsCount && !sink.stopped; ++idx)
+					sink.stopped = !(*sink.visitor)(beginIdx, ends[idx]);
+				break;
+			}
+			return beginIdx + 1;
+		}
+		// scans every start position in [fromIdx, toIdx) into sink
+		void matchRange(Context &ctx, int fromIdx, int toIdx, Matchers &aMatchers, Sink &sink) {
+			if (engine == Reference) {
+				for (int beginIdx = fromIdx; beginIdx < toIdx && !sink.stopped; ) {
+					{
+						Ends rootMatch = compiled -> root -> interpret(ctx, beginIdx, &aMatchers.scratch);
+						beginIdx = collect(sink, beginIdx, rootMatch.data(), rootMatch.size());
+					}
+					// the ends are consumed, so every start position reuses the same blocks
+					aMatchers.scratch.reset();
+				}
+				return;
+			}
+			const Program &program = compiled -> program;
+			const std::vector<Symbol> &tokens = ctx.tokens();
+			std::vector<int> &ends = aMatchers.ends;
+			bool useDfa = engine == DFA;
+			bool firstOnly = sink.mode == ExistsOnly;
+			for (int beginIdx = program.nextStart(tokens, fromIdx); beginIdx < toIdx && !sink.stopped; ) {
+				ends.clear();
+				if (!useDfa || !aMatchers.dfa.matchAt(tokens, beginIdx, ends, firstOnly)) {
+					useDfa = false;
+					aMatchers.nfa.matchAt(tokens, beginIdx, ends, firstOnly);
+				}
+				beginIdx = program.nextStart(tokens, collect(sink, beginIdx, ends.data(), ends.size()));
+			}
+		}
+		void scan(Context &ctx, Sink &sink) {
+			matchRange(ctx, 0, (int)ctx.tokens().size(), *matchers, sink);
+		}
+	public:
+		// every (begin, end) pair, appended to the context
 		void match(Context &ctx) {
-			std::vector<int> rootMatch;
-			for (int beginIdx = 0; beginIdx < ctx.text().size(); ++beginIdx) {
-				rootMatch = root -> interpret(ctx, beginIdx);
-				for (int endIdx : rootMatch) {
-					ctx.result.push_back({beginIdx, endIdx});
+			Sink sink(AllMatches, &ctx.result);
+			scan(ctx, sink);
+		}
+		// stops at the first match
+		bool exists(Context &ctx) {
+			Sink sink(ExistsOnly);
+			scan(ctx, sink);
+			return sink.count;
+		}
+		// as many as match would append, without storing them
+		size_t count(Context &ctx) {
+			Sink sink(CountOnly);
+			scan(ctx, sink);
+			return sink.count;
+		}
+		// the longest non-empty match at the leftmost start, then again after its end
+		void matchLeftmostLongest(Context &ctx) {
+			Sink sink(LeftmostLongest, &ctx.result);
+			scan(ctx, sink);
+		}
+		void match(Context &ctx, const MatchVisitor &visitor) {
+			Sink sink(Visit, nullptr, &visitor);
+			scan(ctx, sink);
+		}
+		// same result as match, start positions are split into chunks that
+		// the pattern's pool of threads shares by work stealing; the pool is
+		// started by the first call and only restarted to grow
+		void matchParallel(Context &ctx, unsigned threadsCount = 0, int chunkSize = 4096) {
+			if (!threadsCount)
+				threadsCount = std::max(1u, std::thread::hardware_concurrency());
+			int tokensCount = (int)ctx.tokens().size();
+			int chunksCount = (tokensCount + chunkSize - 1) / chunkSize;
+			if (threadsCount < 2 || chunksCount < 2) {
+				match(ctx);
+				return;
+			}
+			threadsCount = std::min<unsigned>(threadsCount, chunksCount);
+
+			if (!pool || pool -> size() < threadsCount)
+				pool.reset(new WorkerPool(compiled -> program, threadsCount));
+			ChunkScheduler scheduler(threadsCount, chunksCount);
+			std::vector<std::vector<std::pair<int, int>>> chunkResults(chunksCount);
+			pool -> run({this, &ctx, chunkSize, tokensCount, threadsCount, &scheduler, &chunkResults});
+
+			size_t total = ctx.result.size();
+			for (auto &chunkResult : chunkResults)
+				total += chunkResult.size();
+			ctx.result.reserve(total);
+			for (auto &chunkResult : chunkResults)
+				ctx.result.insert(ctx.result.end(), chunkResult.begin(), chunkResult.end());
+		}
+	};
+
+	// many patterns merged into one NFA and matched in a single pass. A pattern
+	// whose matches all start with the same literal tokens is only seeded where
+	// an Aho-Corasick automaton over symbols finds that prefix. As in
+	// StreamMatcher, each non-empty match end is reported once per pattern,
+	// with its leftmost begin
+	class PatternSet {
+	public:
+		struct PatternMatch {
+			int patternId;
+			int beginIdx;
+			int endIdx;
+		};
+	private:
+		struct PrefixNode {
+			std::unordered_map<Symbol, int> next;
+			int fail = 0;
+			// patterns whose prefix ends here, including through fail links
+			std::vector<int> patterns;
+		};
+		static const int maxPrefixLength = 8;
+
+		std::vector<std::shared_ptr<const CompiledPattern>> compiledPatterns;
+		// states of every pattern, a Match state holds its pattern id as symbol
+		std::vector<Program::State> states;
+		std::vector<int> starts;
+		// closed state set reached after the required prefix, and its length
+		std::vector<std::vector<int>> prefixStates;
+		std::vector<int> prefixLengths;
+		std::vector<PrefixNode> prefixNodes;
+		// patterns without a literal prefix, by the symbols that can begin them
+		std::vector<std::vector<int>> startersBySymbol;
+		std::vector<int> nullablePatterns;
+		SparseSet current, next;
+		std::vector<int> currentBegins, nextBegins;
+		std::vector<int> stack;
+		std::vector<std::pair<int, int>> ended;
+		bool dirty = false;
+
+		void addClosure(SparseSet &set, std::vector<int> &begins, int state, int beginIdx) {
+			int top = 0;
+			stack[top++] = state;
+			while (top) {
+				int s = stack[--top];
+				if (!set.insert(s))
+					continue;
+				begins[s] = beginIdx;
+				const Program::State &st = states[s];
+				if (st.kind == Program::Split) {
+					stack[top++] = st.out1;
+					stack[top++] = st.out;
+				}
+			}
+		}
+		int stepPrefix(int node, Symbol symbol) const {
+			while (true) {
+				auto it = prefixNodes[node].next.find(symbol);
+				if (it != prefixNodes[node].next.end())
+					return it -> second;
+				if (!node)
+					return 0;
+				node = prefixNodes[node].fail;
+			}
+		}
+		// longest token sequence every match of the pattern starts with,
+		// found by stepping the NFA while its live literals agree
+		std::vector<Symbol> requiredPrefix(int patternId) {
+			std::vector<Symbol> prefix;
+			current.clear();
+			addClosure(current, currentBegins, starts[patternId], 0);
+			while ((int)prefix.size() < maxPrefixLength) {
+				bool unique = true, any = false;
+				Symbol symbol = 0;
+				for (int s : current) {
+					const Program::State &st = states[s];
+					if (st.kind == Program::Match)
+						unique = false;
+					else if (st.kind == Program::Literal) {
+						if (any && st.symbol != symbol)
+							unique = false;
+						symbol = st.symbol;
+						any = true;
+					}
+				}
+				if (!unique || !any)
+					break;
+				prefix.push_back(symbol);
+				next.clear();
+				for (int s : current)
+					if (states[s].kind == Program::Literal)
+						addClosure(next, nextBegins, states[s].out, 0);
+				std::swap(current, next);
+			}
+			return prefix;
+		}
+		void compile() {
+			states.clear();
+			starts.clear();
+			for (int patternId = 0; patternId < (int)compiledPatterns.size(); ++patternId) {
+				const Program &program = compiledPatterns[patternId] -> program;
+				int base = (int)states.size();
+				for (Program::State st : program.states) {
+					if (st.kind == Program::Match)
+						st.symbol = patternId;
+					if (st.out >= 0)
+						st.out += base;
+					if (st.out1 >= 0)
+						st.out1 += base;
+					states.push_back(st);
+				}
+				starts.push_back(base + program.start);
+			}
+			current = SparseSet(states.size());
+			next = SparseSet(states.size());
+			currentBegins.assign(states.size(), 0);
+			nextBegins.assign(states.size(), 0);
+			stack.assign(2 * states.size() + 1, 0);
+
+			prefixStates.assign(compiledPatterns.size(), {});
+			prefixLengths.assign(compiledPatterns.size(), 0);
+			prefixNodes.assign(1, PrefixNode());
+			startersBySymbol.clear();
+			nullablePatterns.clear();
+			for (int patternId = 0; patternId < (int)compiledPatterns.size(); ++patternId) {
+				const Program &program = compiledPatterns[patternId] -> program;
+				std::vector<Symbol> prefix = requiredPrefix(patternId);
+				if (prefix.empty()) {
+					if (program.nullable)
+						nullablePatterns.push_back(patternId);
+					else
+						for (Symbol symbol : program.firstSymbols) {
+							if (symbol >= startersBySymbol.size())
+								startersBySymbol.resize(symbol + 1);
+							startersBySymbol[symbol].push_back(patternId);
+						}
+					continue;
+				}
+				prefixStates[patternId].assign(current.begin(), current.end());
+				prefixLengths[patternId] = (int)prefix.size();
+				int node = 0;
+				for (Symbol symbol : prefix) {
+					auto it = prefixNodes[node].next.find(symbol);
+					if (it == prefixNodes[node].next.end()) {
+						prefixNodes.push_back(PrefixNode());
+						it = prefixNodes[node].next.emplace(symbol, (int)prefixNodes.size() - 1).first;
+					}
+					node = it -> second;
+				}
+				prefixNodes[node].patterns.push_back(patternId);
+			}
+
+			// fail links breadth first, so a node's fail target is already complete
+			std::deque<int> queue;
+			for (auto &edge : prefixNodes[0].next)
+				queue.push_back(edge.second);
+			while (!queue.empty()) {
+				int node = queue.front();
+				queue.pop_front();
+				for (auto &edge : prefixNodes[node].next) {
+					int child = edge.second;
+					int fail = node ? stepPrefix(prefixNodes[node].fail, edge.first) : 0;
+					prefixNodes[child].fail = fail;
+					prefixNodes[child].patterns.insert(prefixNodes[child].patterns.end(), prefixNodes[fail].patterns.begin(), prefixNodes[fail].patterns.end());
+					queue.push_back(child);
+				}
+			}
+			dirty = false;
+		}
+	public:
+		PatternSet() : current(0), next(0) {
+		}
+		// returns the id reported with the pattern's matches
+		int add(const std::string &pattern) {
+			compiledPatterns.push_back(PatternCache::getSI() -> get(pattern));
+			dirty = true;
+			return (int)compiledPatterns.size() - 1;
+		}
+		size_t size() const {
+			return compiledPatterns.size();
+		}
+		// appends matches ordered by end, then by pattern id
+		void match(const Context &ctx, std::vector<PatternMatch> &result) {
+			if (dirty)
+				compile();
+			const std::vector<Symbol> &tokens = ctx.tokens();
+			current.clear();
+			int node = 0;
+			for (int idx = 0; idx < (int)tokens.size(); ++idx) {
+				Symbol token = tokens[idx];
+				for (int patternId : nullablePatterns)
+					addClosure(current, currentBegins, starts[patternId], idx);
+				if (token < startersBySymbol.size())
+					for (int patternId : startersBySymbol[token])
+						addClosure(current, currentBegins, starts[patternId], idx);
+
+				next.clear();
+				for (int s : current) {
+					const Program::State &st = states[s];
+					if (st.kind == Program::Literal && st.symbol == token)
+						addClosure(next, nextBegins, st.out, currentBegins[s]);
 				}
+				// prefixed patterns join once the whole prefix has been seen; their
+				// begin is the latest one yet, so older threads keep priority
+				node = stepPrefix(node, token);
+				for (int patternId : prefixNodes[node].patterns) {
+					int beginIdx = idx + 1 - prefixLengths[patternId];
+					for (int s : prefixStates[patternId])
+						if (next.insert(s))
+							nextBegins[s] = beginIdx;
+				}
+				std::swap(current, next);
+				std::swap(currentBegins, nextBegins);
+
+				ended.clear();
+				for (int s : current)
+					if (states[s].kind == Program::Match)
+						ended.push_back({(int)states[s].symbol, currentBegins[s]});
+				std::sort(ended.begin(), ended.end());
+				for (auto &patternEnd : ended)
+					result.push_back({patternEnd.first, patternEnd.second, idx + 1});
 			}
 		}
 	};
@@ -190,8 +1420,224 @@ namespace Interpreter {
 		std::shared_ptr<const vcs> pText = std::make_shared<const vcs>(vcs{"dogs", "texttext", "raining", "texttexttexttext", "raining", "cats", "dogs", "cats", "dogs", "cats", "texttext"});
 		Context ctx(pText);
 
-		RegexPattern pattern("");
+		RegexPattern pattern("raining*&((cats&dogs)|cats)*");
 		pattern.match(ctx);
 		std::cout << ctx;
+
+		// the other result modes build no pair list, or a short one
+		std::cout << "Exists : " << pattern.exists(ctx) << "  count : " << pattern.count(ctx) << std::endl;
+		Context longestCtx(pText);
+		pattern.matchLeftmostLongest(longestCtx);
+		std::cout << "Leftmost longest :" << std::endl << longestCtx;
+		int visited = 0;
+		pattern.match(ctx, [&visited](int beginIdx, int endIdx) {
+			std::cout << "Visited : [" << beginIdx << ", " << endIdx << ")" << std::endl;
+			return ++visited < 3;
+		});
+
+		// differential check of the compiled engines against the reference
+		std::vector<vcs> texts = {
+			*pText,
+			{"raining", "raining", "cats", "cats", "dogs"},
+			{"cats", "dogs", "dogs", "raining"},
+			{}
+		};
+		std::vector<std::string> patterns = {
+			"raining*&((cats&dogs)|cats)*",
+			"(cats|cats)*",
+			"cats & dogs* | raining & (dogs | cats)*",
+			// star bodies that match empty
+			"cats** & (dogs | raining*)*"
+		};
+		bool agree = true;
+		for (auto &patternText : patterns)
+			for (auto &text : texts) {
+				RegexPattern differential(patternText);
+				std::vector<std::vector<std::pair<int, int>>> results;
+				for (RegexPattern::Engine engine : {RegexPattern::Reference, RegexPattern::NFA, RegexPattern::DFA}) {
+					Context engineCtx(std::make_shared<const vcs>(text));
+					differential.setEngine(engine);
+					differential.match(engineCtx);
+					std::vector<std::pair<int, int>> result = engineCtx.matches();
+					std::sort(result.begin(), result.end());
+					result.erase(std::unique(result.begin(), result.end()), result.end());
+					results.push_back(result);
+				}
+				agree = agree && results[0] == results[1] && results[0] == results[2];
+			}
+		std::cout << (agree ? "Engines agree" : "Engines disagree") << std::endl;
+
+#ifdef INTERPRETER_COUNT_ALLOCATIONS
+		// after a warm-up the matchers only reuse their arenas and buffers
+		for (RegexPattern::Engine engine : {RegexPattern::Reference, RegexPattern::NFA, RegexPattern::DFA}) {
+			RegexPattern steady("raining*&((cats&dogs)|cats)*", engine);
+			Context steadyCtx(pText);
+			steady.match(steadyCtx);
+			size_t before = allocationsCount;
+			for (int repeat = 0; repeat < 100; ++repeat) {
+				steadyCtx.clearMatches();
+				steady.match(steadyCtx);
+			}
+			std::cout << "Steady-state allocations, engine " << engine << " : " << allocationsCount - before << std::endl;
+		}
+#endif
+
+		// the same text fed to a stream in small chunks
+		StreamMatcher stream = pattern.stream([](long long beginIdx, long long endIdx) {
+			std::cout << "Streamed match : [" << beginIdx << ", " << endIdx - 1 << "]" << std::endl;
+		});
+		for (size_t from = 0; from < pText -> size(); from += 3)
+			stream.feed(vcs(pText -> begin() + from, pText -> begin() + std::min(from + 3, pText -> size())));
+
+		// several patterns in one pass over the text
+		PatternSet patternSet;
+		for (auto &patternText : patterns)
+			patternSet.add(patternText);
+		std::vector<PatternSet::PatternMatch> setMatches;
+		patternSet.match(ctx, setMatches);
+		for (auto &setMatch : setMatches)
+			std::cout << "Pattern " << setMatch.patternId << " : [" << setMatch.beginIdx << ", " << setMatch.endIdx - 1 << "]" << std::endl;
 	}
-}
+
+	// synthetic benchmark text: background words drawn from a vocabulary of the
+	// given size, with "raining cats dogs" planted at the given density
+	struct CorpusSpec {
+		int tokensCount;
+		int vocabularySize;
+		// probability that a planted match starts at a position
+		double matchDensity;
+		// extra "cats" after each planted match, every prefix of the run is a
+		// match of its own, the worst case for the tree interpreter
+		int repetition;
+	};
+	std::shared_ptr<const std::vector<Symbol>> generateCorpus(const CorpusSpec &spec, uint32_t seed = 12345) {
+		std::vector<Symbol> vocabulary;
+		for (int idx = 0; idx < spec.vocabularySize; ++idx)
+			vocabulary.push_back(SymbolTable::getSI() -> intern("word" + std::to_string(idx)));
+		Symbol raining = SymbolTable::getSI() -> intern("raining");
+		Symbol cats = SymbolTable::getSI() -> intern("cats");
+		Symbol dogs = SymbolTable::getSI() -> intern("dogs");
+		uint32_t threshold = (uint32_t)(spec.matchDensity * 65536);
+
+		std::vector<Symbol> corpus;
+		corpus.reserve(spec.tokensCount);
+		while ((int)corpus.size() < spec.tokensCount) {
+			seed = seed * 1664525 + 1013904223;
+			if ((seed >> 16) < threshold) {
+				corpus.push_back(raining);
+				corpus.push_back(cats);
+				corpus.push_back(dogs);
+				for (int idx = 0; idx < spec.repetition; ++idx)
+					corpus.push_back(cats);
+			} else
+				corpus.push_back(vocabulary[(seed >> 8) % vocabulary.size()]);
+		}
+		corpus.resize(spec.tokensCount);
+		return std::make_shared<const std::vector<Symbol>>(std::move(corpus));
+	}
+
+	void BenchmarkSuite() {
+		// every engine on corpora that vary vocabulary, density and repetition
+		std::vector<CorpusSpec> specs = {
+			{1000000, 1000, 0.01, 0},
+			{1000000, 10, 0.1, 0},
+			{200000, 1000, 0.001, 256}
+		};
+		const char *engineNames[] = {"reference", "NFA", "DFA"};
+		for (auto &spec : specs) {
+			std::shared_ptr<const std::vector<Symbol>> pCorpus = generateCorpus(spec);
+			std::cout << "Corpus : " << spec.tokensCount << " tokens, vocabulary " << spec.vocabularySize;
+			std::cout << ", density " << spec.matchDensity << ", repetition " << spec.repetition << std::endl;
+			// the second pattern matches from every "cats" of a run to every later one
+			for (const char *patternText : {"raining&((cats&dogs)|cats)*", "cats&(cats|dogs)*"})
+			for (RegexPattern::Engine engine : {RegexPattern::Reference, RegexPattern::NFA, RegexPattern::DFA}) {
+				RegexPattern pattern(patternText, engine);
+				Context engineCtx(pCorpus);
+#ifdef INTERPRETER_COUNT_ALLOCATIONS
+				size_t allocationsBefore = allocationsCount;
+				size_t bytesBefore = liveBytes;
+				peakBytes = bytesBefore;
+#endif
+				auto start = std::chrono::steady_clock::now();
+				pattern.match(engineCtx);
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				std::cout << "  " << patternText << ", " << engineNames[engine] << "  tokens/s : " << (long long)(spec.tokensCount / elapsed.count());
+				std::cout << "  matches : " << engineCtx.matches().size();
+#ifdef INTERPRETER_COUNT_ALLOCATIONS
+				std::cout << "  allocations : " << allocationsCount - allocationsBefore;
+				std::cout << "  peak heap : " << (peakBytes - bytesBefore) / 1024 << " KiB";
+#endif
+				std::cout << std::endl;
+			}
+		}
+
+		// synthetic corpus with runs of "cats" and "dogs" after "raining"
+		const int tokensCount = 4000000;
+		vcs words = {"raining", "cats", "dogs", "texttext"};
+		std::vector<Symbol> corpus;
+		corpus.reserve(tokensCount);
+		uint32_t seed = 12345;
+		for (int idx = 0; idx < tokensCount; ++idx) {
+			seed = seed * 1664525 + 1013904223;
+			corpus.push_back(SymbolTable::getSI() -> intern(words[(seed >> 16) % words.size()]));
+		}
+		std::shared_ptr<const std::vector<Symbol>> pTokens = std::make_shared<const std::vector<Symbol>>(std::move(corpus));
+
+		RegexPattern pattern("raining&((cats&dogs)|cats)*");
+		Context sequential(pTokens);
+		auto start = std::chrono::steady_clock::now();
+		pattern.match(sequential);
+		std::chrono::duration<double> baseline = std::chrono::steady_clock::now() - start;
+		std::cout << "Sequential match : " << (long long)(tokensCount / baseline.count()) << " tokens/s" << std::endl;
+
+		unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned threadsCount = 1; ; threadsCount = std::min(threadsCount * 2, maxThreads)) {
+			Context parallel(pTokens);
+			start = std::chrono::steady_clock::now();
+			pattern.matchParallel(parallel, threadsCount);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			std::cout << "Parallel match, threads : " << threadsCount;
+			std::cout << "  tokens/s : " << (long long)(tokensCount / elapsed.count());
+			std::cout << "  speedup : " << baseline.count() / elapsed.count();
+			std::cout << (parallel.matches() == sequential.matches() ? "" : "  (results differ!)") << std::endl;
+			if (threadsCount == maxThreads)
+				break;
+		}
+
+		// hundreds of patterns, each led by its own keyword, one pass against one per pattern
+		const int patternsCount = 200;
+		vcs keywords;
+		for (int idx = 0; idx < patternsCount; ++idx)
+			keywords.push_back("keyword" + std::to_string(idx));
+		std::vector<Symbol> keywordCorpus;
+		keywordCorpus.reserve(tokensCount / 4);
+		for (int idx = 0; idx < tokensCount / 4; ++idx) {
+			seed = seed * 1664525 + 1013904223;
+			if ((seed >> 8) % 16)
+				keywordCorpus.push_back(SymbolTable::getSI() -> intern(words[(seed >> 16) % words.size()]));
+			else
+				keywordCorpus.push_back(SymbolTable::getSI() -> intern(keywords[(seed >> 16) % keywords.size()]));
+		}
+		std::shared_ptr<const std::vector<Symbol>> pKeywordTokens = std::make_shared<const std::vector<Symbol>>(std::move(keywordCorpus));
+		Context keywordCtx(pKeywordTokens);
+		PatternSet patternSet;
+		std::vector<std::unique_ptr<RegexPattern>> separate;
+		for (auto &keyword : keywords) {
+			std::string patternText = keyword + "&(cats|dogs)*&raining";
+			patternSet.add(patternText);
+			separate.emplace_back(new RegexPattern(patternText));
+		}
+		start = std::chrono::steady_clock::now();
+		for (auto &separatePattern : separate) {
+			Context separateCtx(pKeywordTokens);
+			separatePattern -> match(separateCtx);
+		}
+		std::chrono::duration<double> separateTime = std::chrono::steady_clock::now() - start;
+		std::vector<PatternSet::PatternMatch> setMatches;
+		start = std::chrono::steady_clock::now();
+		patternSet.match(keywordCtx, setMatches);
+		std::chrono::duration<double> setTime = std::chrono::steady_clock::now() - start;
+		std::cout << patternsCount << " patterns, one pass each : " << separateTime.count() << " s";
+		std::cout << "  pattern set : " << setTime.count() << " s" << std::endl;
+	}
+}
\ No newline at end of file
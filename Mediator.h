@@ -1,13 +1,83 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 
 #include <unordered_map>
 #include <vector>
-#include <list>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// default history capacity of a chat window
 #define MAX_MSGS_COUNT 10
+// longest frame the front end accepts
+#define MAX_FRAME_LENGTH (1 << 20)
+// frames a slow reader may fall behind by before it is dropped
+#define MAX_PENDING_FRAMES (1 << 16)
+// records attaching a log may walk back, per message the windows hold
+#define MAX_REPLAY_FACTOR 4
+
+#ifdef MEDIATOR_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+// counts calls to operator new, so that runLoad can report what a message
+// costs in allocations from post to its last delivery, and the heap bytes
+// live now and at the peak
+namespace Mediator {
+	std::atomic<size_t> allocationsCount(0);
+	std::atomic<size_t> liveBytes(0);
+	std::atomic<size_t> peakBytes(0);
+}
+void *operator new(size_t size) {
+	++Mediator::allocationsCount;
+	void *memory = malloc(size);
+	if (!memory)
+		throw std::bad_alloc();
+	size_t live = Mediator::liveBytes += malloc_usable_size(memory);
+	size_t peak = Mediator::peakBytes;
+	while (live > peak && !Mediator::peakBytes.compare_exchange_weak(peak, live))
+		;
+	return memory;
+}
+void operator delete(void *memory) noexcept {
+	if (memory)
+		Mediator::liveBytes -= malloc_usable_size(memory);
+	free(memory);
+}
+void operator delete(void *memory, size_t) noexcept {
+	operator delete(memory);
+}
+#endif
 
 namespace Mediator {
 	// clients DB
@@ -27,97 +97,206 @@ namespace Mediator {
 		const std::unordered_map<int, const std::string> &clients() {
 			return records;
 		}
+		// synthetic clients of the load tests are not in the DB
+		std::string name(int UID) {
+			auto it = records.find(UID);
+			return it != records.end() ? it -> second : "Client " + std::to_string(UID);
+		}
 	};
 	ClientsDB *ClientsDB::sharedInstance = nullptr;
 
-	// local time
+	// local time: stamping reads the kernel's coarse clock, the time of the
+	// last tick, from the vDSO without a syscall; formatting is deferred
+	// until a message is rendered
 	class Time {
-		static Time *sharedIntance;
 	protected:
 		Time() {
 		}
 	public:
 		static Time *getSI() {
-			if (!sharedIntance)
-				sharedIntance = new Time();
-			return sharedIntance;
+			static Time sharedIntance;
+			return &sharedIntance;
+		}
+		// milliseconds since the epoch, a few milliseconds behind at most
+		int64_t timestamp() const {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME_COARSE, &now);
+			return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		}
+		// asctime layout without the newline, the last second is cached per thread
+		std::string format(int64_t aTimestamp) const {
+			thread_local time_t cachedSecond = -1;
+			thread_local char cached[32];
+			time_t second = (time_t)(aTimestamp / 1000);
+			if (second != cachedSecond) {
+				struct tm timeInfo;
+				localtime_r(&second, &timeInfo);
+				strftime(cached, sizeof(cached), "%a %b %e %H:%M:%S %Y", &timeInfo);
+				cachedSecond = second;
+			}
+			return cached;
 		}
 		const std::string now() {
-			time_t rawTime;
-			struct tm *timeInfo;
-			time(&rawTime);
-			timeInfo = localtime(&rawTime);
-			std::string localTime = (std::string)asctime(timeInfo);
-			if (!localTime.empty() && localTime.back() == '\n')
-	    		localTime.pop_back();
-	 		return localTime;
+			return format(timestamp());
 		}
 	};
-	Time *Time::sharedIntance = nullptr;
 
-	// message
+	// message: built by the sender, then shared read-only by every window
 	class Message {
-		std::string time;
+		// stamped once at ingest, formatted only when rendered
+		int64_t timestamp = 0;
 		const std::string text;
 		int fromUID;
 		std::vector<int> toUIDs;
+		// -1 when the message is not for a room
+		int roomID = -1;
+		// presence-like messages that offline members never see
+		bool onlineOnly = false;
 	public:
 		Message(const std::string &aText, int aFromUID = -1, const std::vector<int> &aToUIDs = {}) : text(aText), fromUID(aFromUID), toUIDs(aToUIDs){
 		}
-		void setTime(const std::string &aTime) {
-			if (time.empty())
-				time = aTime;
+		void setTimestamp(int64_t aTimestamp) {
+			if (!timestamp)
+				timestamp = aTimestamp;
 		}
-		const std::string &getTime() {
-			return time;
+		int64_t getTimestamp() const {
+			return timestamp;
+		}
+		std::string getTime() const {
+			return Time::getSI() -> format(timestamp);
 		}
 		void setFromUID(int UID) {
 			if (fromUID < 0 && UID >= 0)
 				fromUID = UID;
 		}
-		int getFromUID() {
+		int getFromUID() const {
 			return fromUID;
 		}
 		void setToUIDs(const std::vector<int> &aToUIDs) {
 			if (toUIDs.empty())
 				toUIDs = aToUIDs;
 		}
-		const std::vector<int> & getToUIDs() {
+		const std::vector<int> & getToUIDs() const {
 			return toUIDs;
 		}
-		bool isEmpty() {
-			return text.empty();
+		void setRoomID(int aRoomID) {
+			if (roomID < 0)
+				roomID = aRoomID;
+		}
+		int getRoomID() const {
+			return roomID;
 		}
-		std::unique_ptr<Message> copy() {
-			std::unique_ptr<Message> cpMsg(new Message(text, fromUID));
-			cpMsg -> setTime(time);
-			return cpMsg;
+		void setOnlineOnly(bool anOnlineOnly) {
+			onlineOnly = anOnlineOnly;
+		}
+		bool isOnlineOnly() const {
+			return onlineOnly;
+		}
+		const std::string &getText() const {
+			return text;
+		}
+		bool isEmpty() const {
+			return text.empty();
 		}
 		friend std::ostream &operator<<(std::ostream &os, const Message &msg);
 	};
 	std::ostream &operator<<(std::ostream &os, const Message &msg) {
-		auto &clients = ClientsDB::getSI() -> clients();
-		const std::string &name = clients.at(msg.fromUID);
-		os << name <<  " wrote [" + msg.time + "] : " << msg.text;
+		os << ClientsDB::getSI() -> name(msg.fromUID) << " wrote [" << Time::getSI() -> format(msg.timestamp) << "] : " << msg.text;
 		return os;
 	}
 
+	// fixed-capacity history in one allocation: pushing into a full
+	// buffer overwrites the oldest element in place
+	template <class T>
+	class RingBuffer {
+		std::vector<T> slots;
+		// index of the oldest element
+		size_t first = 0;
+		size_t count = 0;
+	public:
+		RingBuffer(size_t capacity) : slots(capacity) {
+		}
+		void push(T value) {
+			if (slots.empty())
+				return;
+			if (count < slots.size())
+				slots[(first + count++) % slots.size()] = std::move(value);
+			else {
+				slots[first] = std::move(value);
+				first = (first + 1) % slots.size();
+			}
+		}
+		size_t size() const {
+			return count;
+		}
+		bool empty() const {
+			return !count;
+		}
+		size_t capacity() const {
+			return slots.size();
+		}
+		// 0 is the oldest element
+		T &operator[](size_t idx) {
+			return slots[(first + idx) % slots.size()];
+		}
+		const T &operator[](size_t idx) const {
+			return slots[(first + idx) % slots.size()];
+		}
+		// 0 is the newest element
+		const T &fromNewest(size_t idx) const {
+			return (*this)[count - 1 - idx];
+		}
+		// keeps the newest elements that still fit
+		void setCapacity(size_t capacity) {
+			std::vector<T> resized(capacity);
+			size_t kept = std::min(count, capacity);
+			for (size_t idx = 0; idx < kept; ++idx)
+				resized[idx] = std::move((*this)[count - kept + idx]);
+			slots.swap(resized);
+			first = 0;
+			count = kept;
+		}
+	};
+
+	// one window's entry: a handle to the shared message and
+	// the state that differs per recipient
+	struct Delivery {
+		std::shared_ptr<const Message> pMsg;
+		bool read = false;
+	};
+
 	// chat window (interface)
 	class ChatSession;
 	class ChatWindow {
-		std::list<std::unique_ptr<Message>> pMsgs;
+		RingBuffer<Delivery> deliveries;
 		std::weak_ptr<ChatSession> pChatSession;
 	public:
+		ChatWindow(size_t capacity = MAX_MSGS_COUNT) : deliveries(capacity) {
+		}
 		void postMsg(std::unique_ptr<Message> &pMsg);
-		void pushMsg(std::unique_ptr<Message> &pMsg);
+		void pushMsg(const std::shared_ptr<const Message> &pMsg);
 		void setChatSession(std::weak_ptr<ChatSession> ppChatSession);
+		// like rendering, only once the session is flushed
+		size_t unreadCount() const;
+		void markRead();
+		void setCapacity(size_t capacity);
+		size_t capacity() const {
+			return deliveries.capacity();
+		}
+		// the last count messages, newest first
+		template <class Visitor>
+		void forEachRecent(size_t count, Visitor visitor) const {
+			count = std::min(count, deliveries.size());
+			for (size_t idx = 0; idx < count; ++idx)
+				visitor(*deliveries.fromNewest(idx).pMsg);
+		}
 		friend std::ostream &operator<<(std::ostream &os, const ChatWindow &chatWindow);
 	};
 	std::ostream &operator<<(std::ostream &os, const ChatWindow &chatWindow) {
 		os << "Chat window contents : " << std::endl;
-		if (!chatWindow.pMsgs.empty())
-			for (auto &pMsg : chatWindow.pMsgs)
-				os << *pMsg << std::endl;
+		if (!chatWindow.deliveries.empty())
+			for (size_t idx = 0; idx < chatWindow.deliveries.size(); ++idx)
+				os << *chatWindow.deliveries[idx].pMsg << std::endl;
 		else
 			os << "Empty" << std::endl;
 		return os;
@@ -129,44 +308,847 @@ namespace Mediator {
 		const int UID;
 		std::shared_ptr<ChatWindow> pChatWindow;
 	public:
-		Client(int aUID, const std::string &aName) : UID(aUID), pChatWindow(std::make_shared<ChatWindow>()) {
+		Client(int aUID, const std::string &aName, size_t historyCapacity = MAX_MSGS_COUNT) : UID(aUID), pChatWindow(std::make_shared<ChatWindow>(historyCapacity)) {
 		}
 		void postMsg(std::unique_ptr<Message> &pMsg) {
 			pChatWindow -> postMsg(pMsg);
 		}
+		void markRead() {
+			pChatWindow -> markRead();
+		}
+		void printRecent(std::ostream &os, size_t count) const {
+			pChatWindow -> forEachRecent(count, [&os](const Message &msg) {
+				os << msg << std::endl;
+			});
+		}
 		friend std::ostream &operator<<(std::ostream &os, const Client &client);
 		friend class ChatSession;
 	};
 	std::ostream &operator<<(std::ostream &os, const Client &client) {
-		auto &clients = ClientsDB::getSI() -> clients();
-		const std::string &name = clients.at(client.UID);
-		os << "UID : " << client.UID << "  Name : " << name << std::endl;
+		os << "UID : " << client.UID << "  Name : " << ClientsDB::getSI() -> name(client.UID) << "  Unread : " << client.pChatWindow -> unreadCount() << std::endl;
 		os << *(client.pChatWindow);
 		return os;
 	}
 
+	// lock-free multi-producer single-consumer queue: a producer swaps its node
+	// into head and then links it, the consumer follows the links from tail
+	template <class T>
+	class MpscQueue {
+		struct Node {
+			std::atomic<Node *> next{nullptr};
+			T value;
+		};
+		alignas(64) std::atomic<Node *> head;
+		// consumer side, the node before the oldest element
+		alignas(64) Node *tail;
+	public:
+		MpscQueue() {
+			Node *stub = new Node();
+			head = stub;
+			tail = stub;
+		}
+		MpscQueue(const MpscQueue &) = delete;
+		MpscQueue &operator=(const MpscQueue &) = delete;
+		~MpscQueue() {
+			T value;
+			while (pop(value))
+				;
+			delete tail;
+		}
+		void push(T value) {
+			Node *node = new Node();
+			node -> value = std::move(value);
+			Node *prev = head.exchange(node);
+			prev -> next.store(node, std::memory_order_release);
+		}
+		// consumer only, false when empty or a producer has not linked its node yet
+		bool pop(T &value) {
+			Node *next = tail -> next.load(std::memory_order_acquire);
+			if (!next)
+				return false;
+			value = std::move(next -> value);
+			delete tail;
+			tail = next;
+			return true;
+		}
+		// consumer only, also false while a push is half done
+		bool empty() const {
+			return head.load() == tail;
+		}
+	};
+
+	// unbounded single-producer single-consumer queue over linked blocks, so
+	// a producer never waits for its consumer; the consumer handles the
+	// oldest element in place and pops it once it is done with it
+	template <class T>
+	class SpscQueue {
+		static const size_t blockSize = 256;
+		struct Block {
+			T values[blockSize];
+			// published by the pushed count of its first element
+			Block *next = nullptr;
+		};
+		// producer side
+		alignas(64) Block *tailBlock;
+		size_t tailIndex = 0;
+		std::atomic<size_t> pushed{0};
+		// consumer side, with its last look at pushed
+		alignas(64) Block *headBlock;
+		size_t headIndex = 0;
+		size_t pushedSeen = 0;
+		std::atomic<size_t> popped{0};
+	public:
+		SpscQueue() {
+			tailBlock = headBlock = new Block();
+		}
+		SpscQueue(const SpscQueue &) = delete;
+		SpscQueue &operator=(const SpscQueue &) = delete;
+		~SpscQueue() {
+			while (headBlock) {
+				Block *next = headBlock -> next;
+				delete headBlock;
+				headBlock = next;
+			}
+		}
+		void push(T value) {
+			if (tailIndex == blockSize) {
+				tailBlock -> next = new Block();
+				tailBlock = tailBlock -> next;
+				tailIndex = 0;
+			}
+			tailBlock -> values[tailIndex++] = std::move(value);
+			pushed.store(pushed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		// consumer only, nullptr when empty
+		T *front() {
+			size_t count = popped.load(std::memory_order_relaxed);
+			if (count == pushedSeen && count == (pushedSeen = pushed.load(std::memory_order_acquire)))
+				return nullptr;
+			if (headIndex == blockSize) {
+				Block *next = headBlock -> next;
+				delete headBlock;
+				headBlock = next;
+				headIndex = 0;
+			}
+			return &headBlock -> values[headIndex];
+		}
+		// consumer only, after a successful front
+		void pop() {
+			headBlock -> values[headIndex++] = T();
+			popped.store(popped.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		// from any thread, both only grow
+		size_t pushedCount() const {
+			return pushed.load(std::memory_order_acquire);
+		}
+		size_t poppedCount() const {
+			return popped.load(std::memory_order_acquire);
+		}
+	};
+
+	// roaring-style set of UIDs: chunks of 65536 keyed by the high bits, each
+	// a sorted array while sparse and a bitmap once dense, so set operations
+	// between dense chunks run a 64-bit word at a time
+	class UIDSet {
+		static const size_t arrayLimit = 4096;
+		static const size_t bitmapWords = 1024;
+		struct Container {
+			uint32_t key;
+			std::vector<uint16_t> array;
+			std::vector<uint64_t> bitmap;
+			size_t cardinality = 0;
+
+			bool isBitmap() const {
+				return !bitmap.empty();
+			}
+			bool contains(uint16_t low) const {
+				if (isBitmap())
+					return bitmap[low >> 6] >> (low & 63) & 1;
+				return std::binary_search(array.begin(), array.end(), low);
+			}
+			void add(uint16_t low) {
+				if (isBitmap()) {
+					uint64_t bit = (uint64_t)1 << (low & 63);
+					cardinality += !(bitmap[low >> 6] & bit);
+					bitmap[low >> 6] |= bit;
+					return;
+				}
+				auto it = std::lower_bound(array.begin(), array.end(), low);
+				if (it != array.end() && *it == low)
+					return;
+				array.insert(it, low);
+				++cardinality;
+				normalize();
+			}
+			void remove(uint16_t low) {
+				if (isBitmap()) {
+					uint64_t bit = (uint64_t)1 << (low & 63);
+					cardinality -= !!(bitmap[low >> 6] & bit);
+					bitmap[low >> 6] &= ~bit;
+				} else {
+					auto it = std::lower_bound(array.begin(), array.end(), low);
+					if (it == array.end() || *it != low)
+						return;
+					array.erase(it);
+					--cardinality;
+				}
+				normalize();
+			}
+			std::vector<uint64_t> words() const {
+				if (isBitmap())
+					return bitmap;
+				std::vector<uint64_t> materialized(bitmapWords, 0);
+				for (uint16_t low : array)
+					materialized[low >> 6] |= (uint64_t)1 << (low & 63);
+				return materialized;
+			}
+			// a bitmap past the array limit, an array below it
+			void normalize() {
+				if (isBitmap() && cardinality <= arrayLimit) {
+					array.clear();
+					for (size_t word = 0; word < bitmapWords; ++word)
+						for (uint64_t bits = bitmap[word]; bits; bits &= bits - 1)
+							array.push_back((uint16_t)(word * 64 + __builtin_ctzll(bits)));
+					bitmap.clear();
+					bitmap.shrink_to_fit();
+				} else if (!isBitmap() && cardinality > arrayLimit) {
+					bitmap = words();
+					array.clear();
+					array.shrink_to_fit();
+				}
+			}
+		};
+		enum Op {
+			And,
+			Or,
+			AndNot
+		};
+		// sorted by key
+		std::vector<Container> containers;
+
+		// index of the container with key, or of where it would go
+		size_t position(uint32_t key) const {
+			return std::lower_bound(containers.begin(), containers.end(), key, [](const Container &container, uint32_t aKey) {
+				return container.key < aKey;
+			}) - containers.begin();
+		}
+		static Container combine(const Container &a, const Container &b, Op op) {
+			Container result;
+			result.key = a.key;
+			if (!a.isBitmap() && !b.isBitmap()) {
+				auto out = std::back_inserter(result.array);
+				if (op == And)
+					std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+				else if (op == Or)
+					std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+				else
+					std::set_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), out);
+				result.cardinality = result.array.size();
+			} else {
+				result.bitmap = a.words();
+				std::vector<uint64_t> bWords = b.words();
+				for (size_t word = 0; word < bitmapWords; ++word) {
+					if (op == And)
+						result.bitmap[word] &= bWords[word];
+					else if (op == Or)
+						result.bitmap[word] |= bWords[word];
+					else
+						result.bitmap[word] &= ~bWords[word];
+					result.cardinality += __builtin_popcountll(result.bitmap[word]);
+				}
+			}
+			result.normalize();
+			return result;
+		}
+		static UIDSet combine(const UIDSet &a, const UIDSet &b, Op op) {
+			UIDSet result;
+			auto aIt = a.containers.begin(), bIt = b.containers.begin();
+			while (aIt != a.containers.end() || bIt != b.containers.end()) {
+				if (bIt == b.containers.end() || (aIt != a.containers.end() && aIt -> key < bIt -> key)) {
+					if (op != And)
+						result.containers.push_back(*aIt);
+					++aIt;
+				} else if (aIt == a.containers.end() || bIt -> key < aIt -> key) {
+					if (op == Or)
+						result.containers.push_back(*bIt);
+					++bIt;
+				} else {
+					Container container = combine(*aIt++, *bIt++, op);
+					if (container.cardinality)
+						result.containers.push_back(std::move(container));
+				}
+			}
+			return result;
+		}
+	public:
+		void add(int UID) {
+			if (UID < 0) throw "Error!";
+			uint32_t key = (uint32_t)UID >> 16;
+			auto it = containers.begin() + position(key);
+			if (it == containers.end() || it -> key != key) {
+				it = containers.insert(it, Container());
+				it -> key = key;
+			}
+			it -> add((uint16_t)UID);
+		}
+		void remove(int UID) {
+			if (UID < 0)
+				return;
+			auto it = containers.begin() + position((uint32_t)UID >> 16);
+			if (it == containers.end() || it -> key != (uint32_t)UID >> 16)
+				return;
+			it -> remove((uint16_t)UID);
+			if (!it -> cardinality)
+				containers.erase(it);
+		}
+		bool contains(int UID) const {
+			if (UID < 0)
+				return false;
+			auto it = containers.begin() + position((uint32_t)UID >> 16);
+			return it != containers.end() && it -> key == (uint32_t)UID >> 16 && it -> contains((uint16_t)UID);
+		}
+		size_t size() const {
+			size_t count = 0;
+			for (auto &container : containers)
+				count += container.cardinality;
+			return count;
+		}
+		bool empty() const {
+			return containers.empty();
+		}
+		// ascending UIDs, bitmaps visit only their set bits
+		template <class Visitor>
+		void forEach(Visitor visitor) const {
+			for (auto &container : containers) {
+				int base = (int)(container.key << 16);
+				if (container.isBitmap()) {
+					for (size_t word = 0; word < bitmapWords; ++word)
+						for (uint64_t bits = container.bitmap[word]; bits; bits &= bits - 1)
+							visitor(base + (int)(word * 64 + __builtin_ctzll(bits)));
+				} else
+					for (uint16_t low : container.array)
+						visitor(base + low);
+			}
+		}
+		UIDSet operator&(const UIDSet &other) const {
+			return combine(*this, other, And);
+		}
+		UIDSet operator|(const UIDSet &other) const {
+			return combine(*this, other, Or);
+		}
+		UIDSet operator-(const UIDSet &other) const {
+			return combine(*this, other, AndNot);
+		}
+	};
+
+	// durable history: append-only segment files, each with an index of record
+	// offsets beside it. Appends are staged and made durable in batches with one
+	// fdatasync per file; committed records are read in place through mmap
+	class MessageLog {
+	public:
+		// points into the mapped segment, valid as long as the log
+		struct RecordView {
+			int64_t timestamp;
+			int fromUID;
+			int roomID;
+			bool onlineOnly;
+			const int32_t *toUIDs;
+			uint32_t toUIDsCount;
+			std::string_view text;
+		};
+	private:
+		struct RecordHeader {
+			// whole record, padded to 8 bytes
+			uint32_t length;
+			// of the bytes after this field
+			uint32_t checksum;
+			int64_t timestamp;
+			int32_t fromUID;
+			int32_t roomID;
+			uint32_t toUIDsCount;
+			uint32_t textLength;
+			uint32_t onlineOnly;
+			uint32_t reserved;
+		};
+		struct Segment {
+			uint64_t firstRecord;
+			int logFd = -1;
+			int indexFd = -1;
+			// reserved for the whole segment, so views never move
+			const char *map = nullptr;
+			size_t mapLength = 0;
+			// committed part
+			std::vector<uint32_t> offsets;
+			size_t length = 0;
+		};
+		std::string directory;
+		size_t segmentBytes;
+		std::vector<std::unique_ptr<Segment>> segments;
+		uint64_t committedRecords = 0;
+		// staged for the active segment by append, written by commit
+		std::vector<char> pendingData;
+		std::vector<uint32_t> pendingOffsets;
+		// commit against readers, the writer is single
+		mutable std::shared_mutex mutex;
+
+		static uint32_t checksumFNV1a(const char *data, size_t length) {
+			uint32_t hash = 2166136261u;
+			for (size_t idx = 0; idx < length; ++idx)
+				hash = (hash ^ (uint8_t)data[idx]) * 16777619u;
+			return hash;
+		}
+		static void writeAll(int fd, const void *data, size_t length) {
+			const char *bytes = (const char *)data;
+			while (length) {
+				ssize_t written = write(fd, bytes, length);
+				if (written < 0) throw "Error!";
+				bytes += written;
+				length -= written;
+			}
+		}
+		std::string segmentPath(uint64_t firstRecord, const char *extension) const {
+			std::string name = std::to_string(firstRecord);
+			return directory + "/" + std::string(20 - name.size(), '0') + name + extension;
+		}
+		// maps the segment and keeps the prefix of indexed records that check out
+		std::unique_ptr<Segment> openSegment(uint64_t firstRecord) {
+			std::unique_ptr<Segment> segment(new Segment());
+			segment -> firstRecord = firstRecord;
+			segment -> logFd = open(segmentPath(firstRecord, ".log").c_str(), O_RDWR | O_CREAT, 0644);
+			segment -> indexFd = open(segmentPath(firstRecord, ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+			if (segment -> logFd < 0 || segment -> indexFd < 0) throw "Error!";
+			struct stat logStat, indexStat;
+			if (fstat(segment -> logFd, &logStat) || fstat(segment -> indexFd, &indexStat)) throw "Error!";
+			segment -> mapLength = std::max(segmentBytes, (size_t)logStat.st_size);
+			void *map = mmap(nullptr, segment -> mapLength, PROT_READ, MAP_SHARED, segment -> logFd, 0);
+			if (map == MAP_FAILED) throw "Error!";
+			segment -> map = (const char *)map;
+
+			std::vector<uint32_t> offsets(indexStat.st_size / sizeof(uint32_t));
+			if (!offsets.empty() && pread(segment -> indexFd, offsets.data(), offsets.size() * sizeof(uint32_t), 0) < 0) throw "Error!";
+			for (uint32_t offset : offsets) {
+				const RecordHeader *header = (const RecordHeader *)(segment -> map + offset);
+				if (offset != segment -> length || offset + sizeof(RecordHeader) > (size_t)logStat.st_size
+					|| header -> length < sizeof(RecordHeader) || offset + header -> length > (size_t)logStat.st_size
+					|| header -> checksum != checksumFNV1a((const char *)header + 8, header -> length - 8))
+					break;
+				segment -> offsets.push_back(offset);
+				segment -> length += header -> length;
+			}
+			// a torn batch at the end is dropped
+			if (ftruncate(segment -> logFd, segment -> length) || ftruncate(segment -> indexFd, segment -> offsets.size() * sizeof(uint32_t))) throw "Error!";
+			lseek(segment -> logFd, 0, SEEK_END);
+			lseek(segment -> indexFd, 0, SEEK_END);
+			return segment;
+		}
+		// the entries of newly created segment files survive a crash only once
+		// the directory holding them is synced too
+		void syncDirectory() {
+			int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+			if (fd < 0) throw "Error!";
+			int failed = fsync(fd);
+			close(fd);
+			if (failed) throw "Error!";
+		}
+		const Segment &segmentOf(uint64_t record) const {
+			auto it = std::upper_bound(segments.begin(), segments.end(), record, [](uint64_t aRecord, const std::unique_ptr<Segment> &segment) {
+				return aRecord < segment -> firstRecord;
+			});
+			return **(it - 1);
+		}
+	public:
+		MessageLog(const std::string &aDirectory, size_t aSegmentBytes = 64 << 20) : directory(aDirectory), segmentBytes(aSegmentBytes) {
+			std::filesystem::create_directories(directory);
+			std::vector<uint64_t> firstRecords;
+			for (auto &entry : std::filesystem::directory_iterator(directory))
+				if (entry.path().extension() == ".log")
+					firstRecords.push_back(std::stoull(entry.path().stem().string()));
+			std::sort(firstRecords.begin(), firstRecords.end());
+			bool isNew = firstRecords.empty();
+			if (isNew)
+				firstRecords.push_back(0);
+			for (uint64_t firstRecord : firstRecords) {
+				segments.push_back(openSegment(firstRecord));
+				committedRecords = firstRecord + segments.back() -> offsets.size();
+			}
+			if (isNew)
+				syncDirectory();
+		}
+		MessageLog(const MessageLog &) = delete;
+		MessageLog &operator=(const MessageLog &) = delete;
+		// sessions commit every batch they deliver, so little is staged by now;
+		// whatever fails to commit here is lost, a destructor must not throw
+		~MessageLog() {
+			try {
+				commit();
+			} catch (...) {
+			}
+			for (auto &segment : segments) {
+				munmap((void *)segment -> map, segment -> mapLength);
+				close(segment -> logFd);
+				close(segment -> indexFd);
+			}
+		}
+		// stages the message, returns its record number; durable after commit
+		uint64_t append(const Message &msg) {
+			const std::vector<int> &toUIDs = msg.getToUIDs();
+			const std::string &text = msg.getText();
+			size_t length = (sizeof(RecordHeader) + toUIDs.size() * sizeof(int32_t) + text.size() + 7) & ~(size_t)7;
+			if (length > segmentBytes) throw "Error!";
+			if (segments.back() -> length + pendingData.size() + length > segments.back() -> mapLength) {
+				commit();
+				std::unique_ptr<Segment> segment = openSegment(committedRecords);
+				syncDirectory();
+				std::unique_lock<std::shared_mutex> lock(mutex);
+				segments.push_back(std::move(segment));
+			}
+
+			size_t offset = pendingData.size();
+			pendingOffsets.push_back((uint32_t)(segments.back() -> length + offset));
+			pendingData.resize(offset + length, 0);
+			char *record = pendingData.data() + offset;
+			RecordHeader header = {(uint32_t)length, 0, msg.getTimestamp(), msg.getFromUID(), msg.getRoomID(), (uint32_t)toUIDs.size(), (uint32_t)text.size(), msg.isOnlineOnly(), 0};
+			char *payload = record + sizeof(RecordHeader);
+			for (int UID : toUIDs) {
+				int32_t UID32 = UID;
+				memcpy(payload, &UID32, sizeof(UID32));
+				payload += sizeof(UID32);
+			}
+			memcpy(payload, text.data(), text.size());
+			memcpy(record, &header, sizeof(header));
+			header.checksum = checksumFNV1a(record + 8, length - 8);
+			memcpy(record, &header, sizeof(header));
+			return committedRecords + pendingOffsets.size() - 1;
+		}
+		// group commit: one write and one fdatasync per file for every staged record
+		void commit() {
+			if (pendingOffsets.empty())
+				return;
+			Segment &segment = *segments.back();
+			writeAll(segment.logFd, pendingData.data(), pendingData.size());
+			writeAll(segment.indexFd, pendingOffsets.data(), pendingOffsets.size() * sizeof(uint32_t));
+			if (fdatasync(segment.logFd) || fdatasync(segment.indexFd)) throw "Error!";
+
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			segment.offsets.insert(segment.offsets.end(), pendingOffsets.begin(), pendingOffsets.end());
+			segment.length += pendingData.size();
+			committedRecords += pendingOffsets.size();
+			pendingData.clear();
+			pendingOffsets.clear();
+		}
+		// committed records
+		uint64_t size() const {
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			return committedRecords;
+		}
+		RecordView read(uint64_t record) const {
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			if (record >= committedRecords) throw "Error!";
+			const Segment &segment = segmentOf(record);
+			const char *data = segment.map + segment.offsets[record - segment.firstRecord];
+			const RecordHeader *header = (const RecordHeader *)data;
+			const int32_t *toUIDs = (const int32_t *)(data + sizeof(RecordHeader));
+			std::string_view text((const char *)(toUIDs + header -> toUIDsCount), header -> textLength);
+			return {header -> timestamp, header -> fromUID, header -> roomID, header -> onlineOnly != 0, toUIDs, header -> toUIDsCount, text};
+		}
+		std::unique_ptr<Message> load(uint64_t record) const {
+			RecordView view = read(record);
+			std::unique_ptr<Message> pMsg(new Message(std::string(view.text), view.fromUID, std::vector<int>(view.toUIDs, view.toUIDs + view.toUIDsCount)));
+			pMsg -> setTimestamp(view.timestamp);
+			pMsg -> setRoomID(view.roomID);
+			pMsg -> setOnlineOnly(view.onlineOnly);
+			return pMsg;
+		}
+	};
+
+	// sees every delivery on the delivery thread: once per recipient, and
+	// once more after each drained batch
+	class DeliveryListener {
+	public:
+		virtual ~DeliveryListener() {
+		}
+		virtual void onDeliver(int UID, const std::shared_ptr<const Message> &pMsg) = 0;
+		virtual void onBatchDelivered() {
+		}
+	};
+
 	// chat session
 	class ChatSession : public std::enable_shared_from_this<ChatSession> {
-		std::unordered_map<int, std::weak_ptr<ChatWindow>> pChatWindows;
+		// windows indexed by UID - firstUID, the UIDs of a session are dense
+		int firstUID;
+		std::vector<std::weak_ptr<ChatWindow>> pChatWindows;
+		// routing state: registered and online members, rooms, and for every
+		// sender the members who muted it
+		UIDSet members;
+		UIDSet online;
+		std::unordered_map<int, UIDSet> rooms;
+		std::unordered_map<int, UIDSet> mutedBy;
+		UIDSet routed;
+		// every delivered message is appended, committed once per drained batch
+		std::shared_ptr<MessageLog> pLog;
+		DeliveryListener *pListener = nullptr;
+		// a message to fan out, or a routing change; changes share the queue so
+		// they apply in posting order and only the delivery thread routes
+		struct Envelope {
+			std::unique_ptr<Message> pMsg;
+			std::function<void()> change;
+		};
+		// senders only enqueue, fan-out runs on the delivery thread
+		MpscQueue<Envelope> queue;
+		std::atomic<bool> sleeping{false};
+		bool stopping = false;
+		std::mutex wakeMutex;
+		std::condition_variable wakeCondition;
+		std::atomic<size_t> postedCount{0};
+		size_t deliveredCount = 0;
+		std::mutex drainedMutex;
+		std::condition_variable drainedCondition;
+		std::thread deliveryThread;
+		// set when an owner thread drives the session instead
+		std::function<void()> wakeOwner;
+
+		// direct recipients with the sender, a room, or every member; then
+		// without those who muted the sender, and only online ones if asked
+		const UIDSet &route(const Message &msg) {
+			const UIDSet *targets = &members;
+			if (!msg.getToUIDs().empty()) {
+				routed = UIDSet();
+				for (int UID : msg.getToUIDs())
+					routed.add(UID);
+				routed.add(msg.getFromUID());
+				// unknown UIDs, or members of some other session
+				routed = routed & members;
+				targets = &routed;
+			} else if (msg.getRoomID() >= 0) {
+				auto it = rooms.find(msg.getRoomID());
+				if (it == rooms.end()) {
+					routed = UIDSet();
+					return routed;
+				}
+				targets = &it -> second;
+			}
+			auto muted = mutedBy.find(msg.getFromUID());
+			if (muted != mutedBy.end() && !muted -> second.empty()) {
+				routed = *targets - muted -> second;
+				targets = &routed;
+			}
+			if (msg.isOnlineOnly()) {
+				routed = *targets & online;
+				targets = &routed;
+			}
+			return *targets;
+		}
+		void deliveryLoop() {
+			for (;;) {
+				if (drain())
+					continue;
+				// a sender is between its two steps, its message is moments away
+				if (!queue.empty()) {
+					std::this_thread::yield();
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(wakeMutex);
+				if (stopping)
+					return;
+				// a sender checks sleeping after its push, so either it sees
+				// the flag and notifies or the predicate sees its message
+				sleeping = true;
+				wakeCondition.wait(lock, [this] {
+					return stopping || !queue.empty();
+				});
+				sleeping = false;
+			}
+		}
 	public:
+		// with a delivery thread of its own, or driven by an owner thread that
+		// wakeOwner wakes and that calls drain, deliverNow and endBatch
+		ChatSession(int aFirstUID = 0, std::function<void()> aWakeOwner = nullptr) : firstUID(aFirstUID), wakeOwner(aWakeOwner) {
+			if (!wakeOwner)
+				deliveryThread = std::thread(&ChatSession::deliveryLoop, this);
+		}
+		~ChatSession() {
+			{
+				std::lock_guard<std::mutex> lock(wakeMutex);
+				stopping = true;
+			}
+			wakeCondition.notify_one();
+			if (deliveryThread.joinable())
+				deliveryThread.join();
+		}
+		// applies what is queued and ends the batch, on the delivering thread
+		size_t drain() {
+			Envelope envelope;
+			size_t delivered = 0;
+			while (queue.pop(envelope)) {
+				if (envelope.change)
+					envelope.change();
+				else
+					deliverNow(std::shared_ptr<const Message>(std::move(envelope.pMsg)));
+				++delivered;
+			}
+			if (delivered) {
+				endBatch();
+				std::lock_guard<std::mutex> lock(drainedMutex);
+				deliveredCount += delivered;
+				drainedCondition.notify_all();
+			}
+			return delivered;
+		}
+		// every window shares the same payload; delivering thread only
+		void deliverNow(const std::shared_ptr<const Message> &pMsg) {
+			if (pLog)
+				pLog -> append(*pMsg);
+			// only members are routed to, so a message forwarded from another
+			// session reaches just this session's recipients
+			route(*pMsg).forEach([this, &pMsg](int UID) {
+				if ((size_t)(UID - firstUID) < pChatWindows.size())
+					if (auto pChatWindow = pChatWindows[UID - firstUID].lock()) {
+						pChatWindow -> pushMsg(pMsg);
+						if (pListener)
+							pListener -> onDeliver(UID, pMsg);
+					}
+			});
+		}
+		// so flush also means durable
+		void endBatch() {
+			if (pLog)
+				pLog -> commit();
+			if (pListener)
+				pListener -> onBatchDelivered();
+		}
 		void registerClient(const std::unique_ptr<Client> &pClient) {
-			pChatWindows[pClient -> UID] = pClient -> pChatWindow;
+			int UID = pClient -> UID;
+			std::weak_ptr<ChatWindow> pChatWindow = pClient -> pChatWindow;
+			enqueue({nullptr, [this, UID, pChatWindow] {
+				if (UID < firstUID) throw "Error!";
+				if (UID - firstUID >= (int)pChatWindows.size())
+					pChatWindows.resize(UID - firstUID + 1);
+				pChatWindows[UID - firstUID] = pChatWindow;
+				members.add(UID);
+				online.add(UID);
+			}});
 
 			std::shared_ptr<ChatSession> sh = shared_from_this();
 			pClient -> pChatWindow -> setChatSession(sh);
 		}
+		// routing changes apply to the messages posted after them
+		void joinRoom(int roomID, int UID) {
+			enqueue({nullptr, [this, roomID, UID] {
+				rooms[roomID].add(UID);
+			}});
+		}
+		void leaveRoom(int roomID, int UID) {
+			enqueue({nullptr, [this, roomID, UID] {
+				rooms[roomID].remove(UID);
+			}});
+		}
+		// UID stops receiving messages from mutedUID
+		void mute(int UID, int mutedUID, bool isMuted = true) {
+			enqueue({nullptr, [this, UID, mutedUID, isMuted] {
+				if (isMuted)
+					mutedBy[mutedUID].add(UID);
+				else
+					mutedBy[mutedUID].remove(UID);
+			}});
+		}
+		// fills the windows back from the newest records of the log, walking
+		// its index backwards until every window is full, then logs to it; a
+		// member who got few messages would make that the whole log, so the
+		// walk also ends after MAX_REPLAY_FACTOR times what the windows hold
+		void attachLog(std::shared_ptr<MessageLog> aLog) {
+			enqueue({nullptr, [this, aLog] {
+				std::vector<size_t> missing(pChatWindows.size(), 0);
+				size_t windowsMissing = 0;
+				uint64_t recordsLeft = 0;
+				for (size_t idx = 0; idx < pChatWindows.size(); ++idx)
+					if (auto pChatWindow = pChatWindows[idx].lock()) {
+						windowsMissing += (missing[idx] = pChatWindow -> capacity()) > 0;
+						recordsLeft += (uint64_t)pChatWindow -> capacity() * MAX_REPLAY_FACTOR;
+					}
+				std::vector<std::vector<std::shared_ptr<const Message>>> restored(pChatWindows.size());
+				for (uint64_t record = aLog -> size(); record-- > 0 && windowsMissing && recordsLeft--; ) {
+					std::shared_ptr<const Message> pMsg(aLog -> load(record));
+					route(*pMsg).forEach([&](int UID) {
+						size_t idx = UID - firstUID;
+						if (idx < missing.size() && missing[idx]) {
+							restored[idx].push_back(pMsg);
+							windowsMissing -= !--missing[idx];
+						}
+					});
+				}
+				for (size_t idx = 0; idx < restored.size(); ++idx)
+					if (auto pChatWindow = pChatWindows[idx].lock())
+						for (auto it = restored[idx].rbegin(); it != restored[idx].rend(); ++it)
+							pChatWindow -> pushMsg(*it);
+				pLog = aLog;
+			}});
+		}
+		void setOnline(int UID, bool isOnline) {
+			enqueue({nullptr, [this, UID, isOnline] {
+				if (isOnline)
+					online.add(UID);
+				else
+					online.remove(UID);
+			}});
+		}
+		// called on the delivery thread from the next batch on, until replaced
+		void setListener(DeliveryListener *aListener) {
+			enqueue({nullptr, [this, aListener] {
+				pListener = aListener;
+			}});
+		}
+		// safe from any thread, returns once the message is queued
 		void postMsg(std::unique_ptr<Message> &pMsg) {
 			if (!pMsg || pMsg -> isEmpty())
 				return;
-			int fromUID = pMsg -> getFromUID();
-			for (auto &t : pChatWindows)
-				if (auto pChatWindow = t.second.lock()) {
-					int UID = t.first;
-					if (fromUID != UID) {
-						std::unique_ptr<Message> cpMsg = pMsg -> copy();
-						pChatWindow -> pushMsg(cpMsg);
-					}
+			pMsg -> setTimestamp(Time::getSI() -> timestamp());
+			enqueue({std::move(pMsg), nullptr});
+		}
+		// a whole batch for one clock read and at most one wake-up
+		void postMsgs(std::vector<std::unique_ptr<Message>> &pMsgs) {
+			int64_t timestamp = Time::getSI() -> timestamp();
+			size_t count = 0;
+			for (auto &pMsg : pMsgs)
+				count += pMsg && !pMsg -> isEmpty();
+			postedCount += count;
+			for (auto &pMsg : pMsgs)
+				if (pMsg && !pMsg -> isEmpty()) {
+					pMsg -> setTimestamp(timestamp);
+					queue.push({std::move(pMsg), nullptr});
 				}
+			pMsgs.clear();
+			wake();
+		}
+		void enqueue(Envelope envelope) {
+			++postedCount;
+			queue.push(std::move(envelope));
+			wake();
+		}
+		void wake() {
+			if (wakeOwner)
+				wakeOwner();
+			else if (sleeping) {
+				std::lock_guard<std::mutex> lock(wakeMutex);
+				wakeCondition.notify_one();
+			}
+		}
+		// windows have one writer, the delivering thread, so whatever reads or
+		// marks them runs there too; returns once task has run
+		void render(std::function<void()> task) {
+			enqueue({nullptr, task});
+			flush();
+		}
+		// owner thread only
+		bool hasQueued() const {
+			return !queue.empty();
+		}
+		// waits until everything posted so far sits in the windows
+		void flush() {
+			size_t target = postedCount;
+			std::unique_lock<std::mutex> lock(drainedMutex);
+			drainedCondition.wait(lock, [this, target] {
+				return deliveredCount >= target;
+			});
 		}
 	};
 
@@ -174,18 +1156,32 @@ namespace Mediator {
 	void ChatWindow::postMsg(std::unique_ptr<Message> &pMsg) {
 		if (!pMsg || pMsg -> isEmpty())
 			return;
-		std::unique_ptr<Message> cpMsg = pMsg -> copy();
-		pushMsg(pMsg);
+		// the sender's own copy comes back through the delivery thread,
+		// which is the only writer of every window in the session
 		if (auto ppChatSession = pChatSession.lock())
-			ppChatSession -> postMsg(cpMsg);
+			ppChatSession -> postMsg(pMsg);
+		else {
+			pMsg -> setTimestamp(Time::getSI() -> timestamp());
+			pushMsg(std::shared_ptr<const Message>(std::move(pMsg)));
+		}
 	}
-	void ChatWindow::pushMsg(std::unique_ptr<Message> &pMsg) {
+	void ChatWindow::pushMsg(const std::shared_ptr<const Message> &pMsg) {
 		if (!pMsg || pMsg -> isEmpty())
 			return;
-		pMsg -> setTime(Time::getSI() -> now());
-		pMsgs.push_back(std::move(pMsg));
-		if (!pMsgs.empty() && pMsgs.size() > MAX_MSGS_COUNT)
-			pMsgs.pop_front();
+		deliveries.push({pMsg});
+	}
+	size_t ChatWindow::unreadCount() const {
+		size_t count = 0;
+		for (size_t idx = 0; idx < deliveries.size(); ++idx)
+			count += !deliveries[idx].read;
+		return count;
+	}
+	void ChatWindow::markRead() {
+		for (size_t idx = 0; idx < deliveries.size(); ++idx)
+			deliveries[idx].read = true;
+	}
+	void ChatWindow::setCapacity(size_t capacity) {
+		deliveries.setCapacity(capacity);
 	}
 	void ChatWindow::setChatSession(std::weak_ptr<ChatSession> ppChatSession) {
 		pChatSession = ppChatSession;
@@ -193,6 +1189,7 @@ namespace Mediator {
 
 	// chat server
 	class ChatServer {
+		std::shared_ptr<MessageLog> pLog;
 		std::shared_ptr<ChatSession> pChatSession;
 		std::unordered_map<int, std::unique_ptr<Client>> clientsMap;
 	public:
@@ -205,6 +1202,18 @@ namespace Mediator {
 			for (const auto &t : clientsMap)
 				pChatSession -> registerClient(t.second);
 		}
+		// UIDs 0 to clientsCount - 1, for the front end and load tests
+		ChatServer(int clientsCount) : pChatSession(std::make_shared<ChatSession>()) {
+			for (int UID = 0; UID < clientsCount; ++UID) {
+				std::unique_ptr<Client> pClient(new Client(UID, ClientsDB::getSI() -> name(UID)));
+				pChatSession -> registerClient(pClient);
+				clientsMap[UID] = std::move(pClient);
+			}
+		}
+		int clientsCount() const {
+			return (int)clientsMap.size();
+		}
+		// safe from many client threads at once
 		void postMsg(std::unique_ptr<Message> &pMsg, bool shouldPrint = false) {
 			int fromUID = pMsg -> getFromUID();
 			clientsMap.at(fromUID) -> postMsg(pMsg);
@@ -213,11 +1222,1045 @@ namespace Mediator {
 			// from their chat windows on the server
 
 			if (shouldPrint)
-				for (const auto &t : clientsMap)
-					std::cout << *(t.second) << std::endl;
+				pChatSession -> render([this] {
+					for (const auto &t : clientsMap)
+						std::cout << *(t.second) << std::endl;
+				});
+		}
+		// messages straight from the front end, already checked for their senders
+		void postMsgs(std::vector<std::unique_ptr<Message>> &pMsgs) {
+			pChatSession -> postMsgs(pMsgs);
+		}
+		void setListener(DeliveryListener *aListener) {
+			pChatSession -> setListener(aListener);
+		}
+		void flush() {
+			pChatSession -> flush();
+		}
+		void joinRoom(int roomID, int UID) {
+			pChatSession -> joinRoom(roomID, UID);
+		}
+		void mute(int UID, int mutedUID, bool isMuted = true) {
+			pChatSession -> mute(UID, mutedUID, isMuted);
+		}
+		void setOnline(int UID, bool isOnline) {
+			pChatSession -> setOnline(UID, isOnline);
+		}
+		void attachLog(std::shared_ptr<MessageLog> aLog) {
+			pLog = aLog;
+			pChatSession -> attachLog(aLog);
+		}
+		// pages back through the log, straight from the mapped segments; room
+		// messages are left out, past room membership is not kept
+		void printHistory(int UID, size_t count, uint64_t beforeRecord = UINT64_MAX) {
+			flush();
+			std::cout << "History of " << ClientsDB::getSI() -> name(UID) << " : " << std::endl;
+			for (uint64_t record = std::min(beforeRecord, pLog -> size()); record-- > 0 && count; ) {
+				MessageLog::RecordView view = pLog -> read(record);
+				bool visible = view.fromUID == UID || (!view.toUIDsCount && view.roomID < 0) || std::find(view.toUIDs, view.toUIDs + view.toUIDsCount, UID) != view.toUIDs + view.toUIDsCount;
+				if (!visible)
+					continue;
+				std::cout << "#" << record << " " << ClientsDB::getSI() -> name(view.fromUID) << " : " << view.text << std::endl;
+				--count;
+			}
+		}
+		// the printed messages count as read
+		void print(int UID) {
+			Client &client = *clientsMap.at(UID);
+			pChatSession -> render([&client] {
+				std::cout << client << std::endl;
+				client.markRead();
+			});
+		}
+		void printRecent(int UID, size_t count) {
+			Client &client = *clientsMap.at(UID);
+			pChatSession -> render([&client, count] {
+				std::cout << "Last " << count << " messages, newest first : " << std::endl;
+				client.printRecent(std::cout, count);
+			});
+		}
+	};
+
+	// wire format: a uint32 length of the rest of the frame, a type byte and
+	// the fields of that type, in host order since both ends share the host
+	//   hello   : int32 UID, answered by a welcome without fields
+	//   post    : uint32 toUIDsCount, int32 toUIDs[toUIDsCount], text
+	//   deliver : int64 timestamp, int32 fromUID, text
+	enum FrameType : uint8_t {
+		HelloFrame = 1,
+		WelcomeFrame,
+		PostFrame,
+		DeliverFrame
+	};
+	template <class T>
+	void appendField(std::string &out, T value) {
+		out.append((const char *)&value, sizeof(T));
+	}
+	template <class T>
+	T readField(std::string_view &frame) {
+		if (frame.size() < sizeof(T)) throw "Error!";
+		T value;
+		memcpy(&value, frame.data(), sizeof(T));
+		frame.remove_prefix(sizeof(T));
+		return value;
+	}
+	void appendHello(std::string &out, int UID) {
+		appendField<uint32_t>(out, 1 + sizeof(int32_t));
+		appendField<uint8_t>(out, HelloFrame);
+		appendField<int32_t>(out, UID);
+	}
+	void appendPost(std::string &out, std::string_view text, const std::vector<int> &toUIDs = {}) {
+		appendField<uint32_t>(out, 1 + sizeof(uint32_t) + toUIDs.size() * sizeof(int32_t) + text.size());
+		appendField<uint8_t>(out, PostFrame);
+		appendField<uint32_t>(out, toUIDs.size());
+		for (int UID : toUIDs)
+			appendField<int32_t>(out, UID);
+		out.append(text);
+	}
+	// takes the complete frame at the front of data, without its length;
+	// false while it is still incomplete
+	bool nextFrame(std::string_view &data, std::string_view &frame) {
+		if (data.size() < sizeof(uint32_t))
+			return false;
+		uint32_t length;
+		memcpy(&length, data.data(), sizeof(uint32_t));
+		if (!length || length > MAX_FRAME_LENGTH) throw "Error!";
+		if (data.size() < sizeof(uint32_t) + length)
+			return false;
+		frame = data.substr(sizeof(uint32_t), length);
+		data.remove_prefix(sizeof(uint32_t) + length);
+		return true;
+	}
+
+	// non-blocking TCP front end: one epoll loop per core, each accepting on
+	// its own SO_REUSEPORT socket so the kernel spreads the connections.
+	// A loop hands everything one wake-up read to the session as one batch,
+	// and the delivery thread queues the fan-out back to the loop owning each
+	// recipient, which coalesces it into as few writes as the socket takes
+	class ChatFrontEnd : public DeliveryListener {
+		// the text stays in the shared message, only the header is per frame
+		struct OutFrame {
+			char header[17];
+			uint8_t headerLength;
+			std::shared_ptr<const Message> pMsg;
+			size_t size() const {
+				return headerLength + (pMsg ? pMsg -> getText().size() : 0);
+			}
+		};
+		struct Connection {
+			int fd;
+			// -1 until its hello
+			int UID = -1;
+			std::string input;
+			std::deque<OutFrame> output;
+			// of the oldest output frame, already written
+			size_t outputOffset = 0;
+			bool writeArmed = false;
+		};
+		struct Outgoing {
+			int UID;
+			std::shared_ptr<const Message> pMsg;
+		};
+		struct Loop {
+			int index;
+			int epollFd = -1;
+			int listenFd = -1;
+			int wakeFd = -1;
+			// touched by the loop thread only
+			std::unordered_map<int, std::unique_ptr<Connection>> connections;
+			std::unordered_map<int, Connection *> connectionsByUID;
+			std::vector<std::unique_ptr<Message>> batch;
+			// filled by delivery threads, drained when wakeFd fires
+			MpscQueue<Outgoing> outbox;
+			std::atomic<bool> hasOutgoing{false};
+			std::thread thread;
+		};
+		ChatServer &server;
+		uint16_t port = 0;
+		std::atomic<bool> stopping{false};
+		std::vector<std::unique_ptr<Loop>> loops;
+		// loop index of the connection of every UID, -1 when not connected
+		int clientsCount;
+		std::unique_ptr<std::atomic<int>[]> loopOfUID;
+
+		void wake(Loop &loop) {
+			uint64_t one = 1;
+			// only fails when the counter is saturated, and then it is set anyway
+			ssize_t written = write(loop.wakeFd, &one, sizeof(one));
+			(void)written;
+		}
+		void addToEpoll(Loop &loop, int fd, uint32_t events) {
+			epoll_event event{};
+			event.events = events;
+			event.data.fd = fd;
+			if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event)) throw "Error!";
+		}
+		void accept(Loop &loop) {
+			for (;;) {
+				int fd = accept4(loop.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd < 0) {
+					if (errno == EINTR)
+						continue;
+					return;
+				}
+				int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				std::unique_ptr<Connection> pConnection(new Connection());
+				pConnection -> fd = fd;
+				loop.connections[fd] = std::move(pConnection);
+				addToEpoll(loop, fd, EPOLLIN | EPOLLRDHUP);
+			}
+		}
+		void disconnect(Loop &loop, Connection &connection) {
+			epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, connection.fd, nullptr);
+			close(connection.fd);
+			if (connection.UID >= 0) {
+				loop.connectionsByUID.erase(connection.UID);
+				loopOfUID[connection.UID] = -1;
+				server.setOnline(connection.UID, false);
+			}
+			loop.connections.erase(connection.fd);
+		}
+		void pushFrame(Connection &connection, FrameType type, const std::shared_ptr<const Message> &pMsg = nullptr) {
+			connection.output.emplace_back();
+			OutFrame &frame = connection.output.back();
+			std::string header;
+			if (pMsg) {
+				appendField<uint32_t>(header, 1 + sizeof(int64_t) + sizeof(int32_t) + pMsg -> getText().size());
+				appendField<uint8_t>(header, type);
+				appendField<int64_t>(header, pMsg -> getTimestamp());
+				appendField<int32_t>(header, pMsg -> getFromUID());
+			} else {
+				appendField<uint32_t>(header, 1);
+				appendField<uint8_t>(header, type);
+			}
+			memcpy(frame.header, header.data(), header.size());
+			frame.headerLength = header.size();
+			frame.pMsg = pMsg;
+		}
+		// false once the connection has to go
+		bool handleFrame(Loop &loop, Connection &connection, std::string_view frame) {
+			uint8_t type = readField<uint8_t>(frame);
+			if (type == HelloFrame) {
+				int UID = readField<int32_t>(frame);
+				int notConnected = -1;
+				// one connection per UID, across all loops
+				if (connection.UID >= 0 || UID < 0 || UID >= clientsCount || !loopOfUID[UID].compare_exchange_strong(notConnected, loop.index))
+					return false;
+				connection.UID = UID;
+				loop.connectionsByUID[UID] = &connection;
+				server.setOnline(UID, true);
+				pushFrame(connection, WelcomeFrame);
+				return true;
+			}
+			if (type == PostFrame && connection.UID >= 0) {
+				uint32_t toUIDsCount = readField<uint32_t>(frame);
+				if (toUIDsCount > frame.size() / sizeof(int32_t)) throw "Error!";
+				std::vector<int> toUIDs(toUIDsCount);
+				for (int &UID : toUIDs)
+					UID = readField<int32_t>(frame);
+				loop.batch.emplace_back(new Message(std::string(frame), connection.UID, toUIDs));
+				return true;
+			}
+			return false;
+		}
+		bool readInput(Loop &loop, Connection &connection) {
+			char buffer[65536];
+			// frames that came in before the peer closed still count
+			bool closed = false;
+			// a bounded share per wake-up, so one busy sender cannot starve the loop
+			for (int round = 0; round < 16; ++round) {
+				ssize_t length = recv(connection.fd, buffer, sizeof(buffer), 0);
+				if (!length) {
+					closed = true;
+					break;
+				}
+				if (length < 0) {
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						break;
+					return false;
+				}
+				connection.input.append(buffer, length);
+				if (length < (ssize_t)sizeof(buffer))
+					break;
+			}
+			std::string_view data(connection.input), frame;
+			try {
+				while (nextFrame(data, frame))
+					if (!handleFrame(loop, connection, frame))
+						return false;
+			} catch (const char *) {
+				return false;
+			}
+			connection.input.erase(0, connection.input.size() - data.size());
+			if (closed)
+				return false;
+			return connection.output.empty() || flushOutput(loop, connection);
+		}
+		// gathers the pending frames into one writev (sendmsg, to skip SIGPIPE)
+		// per round until the socket buffer is full, then waits for EPOLLOUT
+		bool flushOutput(Loop &loop, Connection &connection) {
+			while (!connection.output.empty()) {
+				iovec iov[256];
+				size_t iovCount = 0;
+				size_t offset = connection.outputOffset;
+				for (auto it = connection.output.begin(); it != connection.output.end() && iovCount + 2 <= 256; ++it, offset = 0) {
+					if (offset < it -> headerLength)
+						iov[iovCount++] = {it -> header + offset, it -> headerLength - offset};
+					if (it -> pMsg) {
+						const std::string &text = it -> pMsg -> getText();
+						size_t textOffset = offset > it -> headerLength ? offset - it -> headerLength : 0;
+						iov[iovCount++] = {(void *)(text.data() + textOffset), text.size() - textOffset};
+					}
+				}
+				msghdr msg{};
+				msg.msg_iov = iov;
+				msg.msg_iovlen = iovCount;
+				ssize_t written = sendmsg(connection.fd, &msg, MSG_NOSIGNAL);
+				if (written < 0) {
+					if (errno == EINTR)
+						continue;
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						break;
+					return false;
+				}
+				while (written) {
+					size_t remaining = connection.output.front().size() - connection.outputOffset;
+					if ((size_t)written < remaining) {
+						connection.outputOffset += written;
+						break;
+					}
+					written -= remaining;
+					connection.outputOffset = 0;
+					connection.output.pop_front();
+				}
+			}
+			bool wantWrite = !connection.output.empty();
+			if (connection.output.size() > MAX_PENDING_FRAMES)
+				return false;
+			if (wantWrite != connection.writeArmed) {
+				epoll_event event{};
+				event.events = EPOLLIN | EPOLLRDHUP | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+				event.data.fd = connection.fd;
+				epoll_ctl(loop.epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+				connection.writeArmed = wantWrite;
+			}
+			return true;
+		}
+		void drainOutbox(Loop &loop) {
+			uint64_t value;
+			ssize_t length = read(loop.wakeFd, &value, sizeof(value));
+			(void)length;
+			std::vector<Connection *> touched;
+			Outgoing outgoing;
+			while (loop.outbox.pop(outgoing)) {
+				auto it = loop.connectionsByUID.find(outgoing.UID);
+				if (it == loop.connectionsByUID.end())
+					continue;
+				// a connection already waiting for EPOLLOUT gets flushed then
+				if (it -> second -> output.empty())
+					touched.push_back(it -> second);
+				pushFrame(*it -> second, DeliverFrame, outgoing.pMsg);
+			}
+			for (Connection *pConnection : touched)
+				if (!flushOutput(loop, *pConnection))
+					disconnect(loop, *pConnection);
+		}
+		void run(Loop &loop) {
+			epoll_event events[256];
+			while (!stopping) {
+				int count = epoll_wait(loop.epollFd, events, 256, -1);
+				for (int idx = 0; idx < count; ++idx) {
+					int fd = events[idx].data.fd;
+					if (fd == loop.listenFd) {
+						accept(loop);
+						continue;
+					}
+					if (fd == loop.wakeFd) {
+						drainOutbox(loop);
+						continue;
+					}
+					auto it = loop.connections.find(fd);
+					if (it == loop.connections.end())
+						continue;
+					Connection &connection = *it -> second;
+					bool alive = true;
+					if (events[idx].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+						alive = readInput(loop, connection);
+					if (alive && (events[idx].events & EPOLLOUT))
+						alive = flushOutput(loop, connection);
+					if (!alive)
+						disconnect(loop, connection);
+				}
+				// everything this wake-up read goes to the session at once
+				if (!loop.batch.empty())
+					server.postMsgs(loop.batch);
+			}
+		}
+	public:
+		// listens on the loopback, on an ephemeral port unless one is given
+		ChatFrontEnd(ChatServer &aServer, uint16_t aPort = 0, size_t loopsCount = std::thread::hardware_concurrency()) : server(aServer), port(aPort), clientsCount(aServer.clientsCount()), loopOfUID(new std::atomic<int>[aServer.clientsCount()]) {
+			for (int UID = 0; UID < clientsCount; ++UID)
+				loopOfUID[UID] = -1;
+			loopsCount = std::max<size_t>(loopsCount, 1);
+			for (size_t idx = 0; idx < loopsCount; ++idx) {
+				std::unique_ptr<Loop> pLoop(new Loop());
+				pLoop -> index = idx;
+				pLoop -> listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+				if (pLoop -> listenFd < 0) throw "Error!";
+				int one = 1;
+				setsockopt(pLoop -> listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+				if (setsockopt(pLoop -> listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) throw "Error!";
+				sockaddr_in address{};
+				address.sin_family = AF_INET;
+				address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+				address.sin_port = htons(port);
+				if (bind(pLoop -> listenFd, (sockaddr *)&address, sizeof(address))) throw "Error!";
+				// the other loops join the port the first one got
+				socklen_t addressLength = sizeof(address);
+				getsockname(pLoop -> listenFd, (sockaddr *)&address, &addressLength);
+				port = ntohs(address.sin_port);
+				if (listen(pLoop -> listenFd, SOMAXCONN)) throw "Error!";
+				pLoop -> epollFd = epoll_create1(EPOLL_CLOEXEC);
+				pLoop -> wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if (pLoop -> epollFd < 0 || pLoop -> wakeFd < 0) throw "Error!";
+				addToEpoll(*pLoop, pLoop -> listenFd, EPOLLIN);
+				addToEpoll(*pLoop, pLoop -> wakeFd, EPOLLIN);
+				loops.push_back(std::move(pLoop));
+			}
+			server.setListener(this);
+			for (auto &pLoop : loops)
+				pLoop -> thread = std::thread(&ChatFrontEnd::run, this, std::ref(*pLoop));
+		}
+		ChatFrontEnd(const ChatFrontEnd &) = delete;
+		ChatFrontEnd &operator=(const ChatFrontEnd &) = delete;
+		~ChatFrontEnd() {
+			// once flushed, no delivery thread calls back into this
+			server.setListener(nullptr);
+			server.flush();
+			stopping = true;
+			for (auto &pLoop : loops)
+				wake(*pLoop);
+			for (auto &pLoop : loops) {
+				pLoop -> thread.join();
+				for (auto &t : pLoop -> connections)
+					close(t.first);
+				close(pLoop -> listenFd);
+				close(pLoop -> wakeFd);
+				close(pLoop -> epollFd);
+			}
+		}
+		uint16_t getPort() const {
+			return port;
+		}
+		virtual void onDeliver(int UID, const std::shared_ptr<const Message> &pMsg) {
+			if (UID < 0 || UID >= clientsCount)
+				return;
+			int loopIndex = loopOfUID[UID];
+			if (loopIndex < 0)
+				return;
+			Loop &loop = *loops[loopIndex];
+			loop.outbox.push({UID, pMsg});
+			loop.hasOutgoing.store(true, std::memory_order_release);
+		}
+		// one eventfd write per loop and batch, not per delivery
+		virtual void onBatchDelivered() {
+			for (auto &pLoop : loops)
+				if (pLoop -> hasOutgoing.exchange(false))
+					wake(*pLoop);
+		}
+	};
+
+	// blocking loopback client of the front end; one thread may post while
+	// another receives
+	class ChatClient {
+		int fd;
+		std::string input;
+		// of input, by the frame returned last
+		size_t consumed = 0;
+		std::string output;
+	public:
+		struct Delivery {
+			int64_t timestamp;
+			int fromUID;
+			std::string text;
+		};
+		// returns once the server has welcomed UID
+		ChatClient(uint16_t port, int UID) {
+			fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (fd < 0) throw "Error!";
+			sockaddr_in address{};
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			address.sin_port = htons(port);
+			if (connect(fd, (sockaddr *)&address, sizeof(address))) {
+				close(fd);
+				throw "Error!";
+			}
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			// nothing in the tests may hang forever
+			timeval timeout{10, 0};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			appendHello(output, UID);
+			send();
+			std::string_view frame;
+			if (!receiveFrame(frame) || readField<uint8_t>(frame) != WelcomeFrame) {
+				close(fd);
+				throw "Error!";
+			}
+		}
+		ChatClient(const ChatClient &) = delete;
+		ChatClient &operator=(const ChatClient &) = delete;
+		~ChatClient() {
+			close(fd);
+		}
+		// buffered until send
+		void post(std::string_view text, const std::vector<int> &toUIDs = {}) {
+			appendPost(output, text, toUIDs);
+		}
+		void send() {
+			for (size_t sent = 0; sent < output.size(); ) {
+				ssize_t length = ::send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+				if (length < 0 && errno != EINTR) throw "Error!";
+				sent += std::max<ssize_t>(length, 0);
+			}
+			output.clear();
+		}
+		// the frame stays valid until the next call; false on close or timeout
+		bool receiveFrame(std::string_view &frame) {
+			input.erase(0, consumed);
+			consumed = 0;
+			for (;;) {
+				std::string_view data(input);
+				if (nextFrame(data, frame)) {
+					consumed = input.size() - data.size();
+					return true;
+				}
+				char buffer[65536];
+				ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+				if (length < 0 && errno == EINTR)
+					continue;
+				if (length <= 0)
+					return false;
+				input.append(buffer, length);
+			}
+		}
+		bool receive(Delivery &delivery) {
+			std::string_view frame;
+			if (!receiveFrame(frame) || readField<uint8_t>(frame) != DeliverFrame)
+				return false;
+			delivery.timestamp = readField<int64_t>(frame);
+			delivery.fromUID = readField<int32_t>(frame);
+			delivery.text.assign(frame);
+			return true;
+		}
+	};
+
+	// bundled load generator: clientsCount clients connect over the loopback
+	// and each posts postsPerClient broadcasts, while reading the fan-out
+	// back until it has every message or the server stops sending
+	struct LoadReport {
+		size_t posted;
+		size_t delivered;
+		double seconds;
+	};
+	LoadReport generateLoad(uint16_t port, int clientsCount, int postsPerClient, int postsPerSend = 64) {
+		std::vector<std::unique_ptr<ChatClient>> pClients;
+		for (int UID = 0; UID < clientsCount; ++UID)
+			pClients.emplace_back(new ChatClient(port, UID));
+		std::atomic<size_t> delivered{0};
+		size_t expected = (size_t)clientsCount * postsPerClient;
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (auto &pClient : pClients) {
+			ChatClient &client = *pClient;
+			threads.emplace_back([&client, postsPerClient, postsPerSend] {
+				for (int idx = 0; idx < postsPerClient; ++idx) {
+					client.post("Load message " + std::to_string(idx));
+					if ((idx + 1) % postsPerSend == 0)
+						client.send();
+				}
+				client.send();
+			});
+			threads.emplace_back([&client, &delivered, expected] {
+				ChatClient::Delivery delivery;
+				for (size_t count = 0; count < expected && client.receive(delivery); ++count)
+					++delivered;
+			});
+		}
+		for (auto &thread : threads)
+			thread.join();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		return {(size_t)clientsCount * postsPerClient, delivered, elapsed.count()};
+	}
+
+	// many sessions over shards, shared-nothing: every shard is one worker
+	// thread that owns its sessions, their routing state and the windows of
+	// their clients. Session s has UIDs s * clientsPerSession onwards and
+	// lives on shard s % shardsCount, so finding either is arithmetic. Posts
+	// come in over one SPSC lane per producer and shard; a direct message to
+	// clients of another session goes on to that session's shard over the
+	// SPSC lane between the two shards, sharing the payload
+	class ShardedChatServer {
+		struct Post {
+			std::unique_ptr<Message> pMsg;
+		};
+		struct Forward {
+			int sessionID;
+			std::shared_ptr<const Message> pMsg;
+		};
+		struct Shard {
+			// indexed by sessionID / shardsCount
+			std::vector<std::shared_ptr<ChatSession>> pSessions;
+			// one lane per producer, and one per shard, this one's included
+			std::vector<std::unique_ptr<SpscQueue<Post>>> postLanes;
+			std::vector<std::unique_ptr<SpscQueue<Forward>>> forwardLanes;
+			std::vector<char> touched;
+			std::atomic<bool> sleeping{false};
+			bool stopping = false;
+			std::mutex wakeMutex;
+			std::condition_variable wakeCondition;
+			std::mutex drainedMutex;
+			std::condition_variable drainedCondition;
+			std::thread worker;
+
+			// pairs with the fence after sleeping is set: the lanes publish
+			// with release stores only, which a later load may pass
+			void wake() {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (sleeping) {
+					std::lock_guard<std::mutex> lock(wakeMutex);
+					wakeCondition.notify_one();
+				}
+			}
+			bool hasWork() {
+				for (auto &pLane : postLanes)
+					if (pLane -> front())
+						return true;
+				for (auto &pLane : forwardLanes)
+					if (pLane -> front())
+						return true;
+				for (auto &pSession : pSessions)
+					if (pSession -> hasQueued())
+						return true;
+				return false;
+			}
+		};
+		const int sessionsCount;
+		const int clientsPerSession;
+		std::vector<std::unique_ptr<Shard>> shards;
+		// indexed by UID, only for printing
+		std::vector<std::unique_ptr<Client>> clients;
+
+		ChatSession &sessionOn(Shard &shard, int sessionID) {
+			shard.touched[sessionID / shards.size()] = true;
+			return *shard.pSessions[sessionID / shards.size()];
+		}
+		// the sessions of the direct recipients outside the sender's get it too
+		void deliver(size_t shardIndex, std::unique_ptr<Message> &pMsg, std::vector<char> &wakeShards) {
+			Shard &shard = *shards[shardIndex];
+			int sessionID = sessionOf(pMsg -> getFromUID());
+			std::shared_ptr<const Message> pShared(std::move(pMsg));
+			sessionOn(shard, sessionID).deliverNow(pShared);
+			const std::vector<int> &toUIDs = pShared -> getToUIDs();
+			for (size_t idx = 0; idx < toUIDs.size(); ++idx) {
+				int toSessionID = sessionOf(toUIDs[idx]);
+				if (toSessionID == sessionID || toSessionID < 0)
+					continue;
+				bool seen = false;
+				for (size_t prev = 0; prev < idx && !seen; ++prev)
+					seen = sessionOf(toUIDs[prev]) == toSessionID;
+				if (seen)
+					continue;
+				size_t toShardIndex = shardOf(toSessionID);
+				if (toShardIndex == shardIndex)
+					sessionOn(shard, toSessionID).deliverNow(pShared);
+				else {
+					shards[toShardIndex] -> forwardLanes[shardIndex] -> push({toSessionID, pShared});
+					wakeShards[toShardIndex] = true;
+				}
+			}
+		}
+		void work(size_t shardIndex) {
+			Shard &shard = *shards[shardIndex];
+			std::vector<char> wakeShards(shards.size(), false);
+			for (;;) {
+				size_t processed = 0;
+				// routing changes, and posts through the clients' windows
+				for (auto &pSession : shard.pSessions)
+					processed += pSession -> drain();
+				// a bounded share of every lane per round, so none starves
+				for (auto &pLane : shard.postLanes)
+					for (int count = 0; count < 256; ++count) {
+						Post *post = pLane -> front();
+						if (!post)
+							break;
+						deliver(shardIndex, post -> pMsg, wakeShards);
+						pLane -> pop();
+						++processed;
+					}
+				for (auto &pLane : shard.forwardLanes)
+					for (int count = 0; count < 256; ++count) {
+						Forward *forward = pLane -> front();
+						if (!forward)
+							break;
+						sessionOn(shard, forward -> sessionID).deliverNow(forward -> pMsg);
+						pLane -> pop();
+						++processed;
+					}
+				for (size_t idx = 0; idx < shard.touched.size(); ++idx)
+					if (shard.touched[idx]) {
+						shard.pSessions[idx] -> endBatch();
+						shard.touched[idx] = false;
+					}
+				for (size_t idx = 0; idx < wakeShards.size(); ++idx)
+					if (wakeShards[idx]) {
+						shards[idx] -> wake();
+						wakeShards[idx] = false;
+					}
+				if (processed) {
+					std::lock_guard<std::mutex> lock(shard.drainedMutex);
+					shard.drainedCondition.notify_all();
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(shard.wakeMutex);
+				if (shard.stopping)
+					return;
+				// the same handshake as a session's delivery thread
+				shard.sleeping = true;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				shard.wakeCondition.wait(lock, [&shard] {
+					return shard.stopping || shard.hasWork();
+				});
+				shard.sleeping = false;
+			}
+		}
+		template <class Lanes>
+		void waitForLanes(Shard &shard, Lanes &lanes) {
+			std::vector<size_t> targets;
+			for (auto &pLane : lanes)
+				targets.push_back(pLane -> pushedCount());
+			std::unique_lock<std::mutex> lock(shard.drainedMutex);
+			shard.drainedCondition.wait(lock, [&lanes, &targets] {
+				for (size_t idx = 0; idx < lanes.size(); ++idx)
+					if (lanes[idx] -> poppedCount() < targets[idx])
+						return false;
+				return true;
+			});
+		}
+	public:
+		// posts into the shards from one thread at a time
+		class Producer {
+			ShardedChatServer *pServer;
+			size_t index;
+		public:
+			Producer(ShardedChatServer *aServer, size_t anIndex) : pServer(aServer), index(anIndex) {
+			}
+			void postMsg(std::unique_ptr<Message> &pMsg) {
+				if (!pMsg || pMsg -> isEmpty())
+					return;
+				int sessionID = pServer -> sessionOf(pMsg -> getFromUID());
+				if (sessionID < 0) throw "Error!";
+				pMsg -> setTimestamp(Time::getSI() -> timestamp());
+				Shard &shard = *pServer -> shards[pServer -> shardOf(sessionID)];
+				shard.postLanes[index] -> push({std::move(pMsg)});
+				shard.wake();
+			}
+		};
+		ShardedChatServer(int aSessionsCount, int aClientsPerSession, size_t producersCount, size_t shardsCount = std::thread::hardware_concurrency()) : sessionsCount(aSessionsCount), clientsPerSession(aClientsPerSession) {
+			shardsCount = std::max<size_t>(1, std::min<size_t>(shardsCount, sessionsCount));
+			for (size_t shardIndex = 0; shardIndex < shardsCount; ++shardIndex) {
+				std::unique_ptr<Shard> pShard(new Shard());
+				for (size_t idx = 0; idx < producersCount; ++idx)
+					pShard -> postLanes.emplace_back(new SpscQueue<Post>());
+				for (size_t idx = 0; idx < shardsCount; ++idx)
+					pShard -> forwardLanes.emplace_back(new SpscQueue<Forward>());
+				shards.push_back(std::move(pShard));
+			}
+			for (int sessionID = 0; sessionID < sessionsCount; ++sessionID) {
+				Shard *pShard = shards[shardOf(sessionID)].get();
+				pShard -> pSessions.push_back(std::make_shared<ChatSession>(sessionID * clientsPerSession, [pShard] {
+					pShard -> wake();
+				}));
+				pShard -> touched.push_back(false);
+				for (int UID = sessionID * clientsPerSession; UID < (sessionID + 1) * clientsPerSession; ++UID) {
+					clients.emplace_back(new Client(UID, ClientsDB::getSI() -> name(UID)));
+					pShard -> pSessions.back() -> registerClient(clients.back());
+				}
+			}
+			for (size_t shardIndex = 0; shardIndex < shardsCount; ++shardIndex)
+				shards[shardIndex] -> worker = std::thread(&ShardedChatServer::work, this, shardIndex);
+		}
+		ShardedChatServer(const ShardedChatServer &) = delete;
+		ShardedChatServer &operator=(const ShardedChatServer &) = delete;
+		~ShardedChatServer() {
+			for (auto &pShard : shards) {
+				{
+					std::lock_guard<std::mutex> lock(pShard -> wakeMutex);
+					pShard -> stopping = true;
+				}
+				pShard -> wakeCondition.notify_one();
+				pShard -> worker.join();
+			}
+		}
+		Producer producer(size_t index) {
+			if (index >= shards[0] -> postLanes.size()) throw "Error!";
+			return Producer(this, index);
+		}
+		int sessionOf(int UID) const {
+			return UID >= 0 && UID < sessionsCount * clientsPerSession ? UID / clientsPerSession : -1;
+		}
+		size_t shardOf(int sessionID) const {
+			return sessionID % shards.size();
+		}
+		size_t shardsCount() const {
+			return shards.size();
+		}
+		// on every session, called from the shard threads
+		void setListener(DeliveryListener *aListener) {
+			for (auto &pShard : shards)
+				for (auto &pSession : pShard -> pSessions)
+					pSession -> setListener(aListener);
+		}
+		// routing changes go to the session of UID, on its shard
+		void joinRoom(int roomID, int UID) {
+			shards[shardOf(sessionOf(UID))] -> pSessions[sessionOf(UID) / shards.size()] -> joinRoom(roomID, UID);
+		}
+		void mute(int UID, int mutedUID, bool isMuted = true) {
+			shards[shardOf(sessionOf(UID))] -> pSessions[sessionOf(UID) / shards.size()] -> mute(UID, mutedUID, isMuted);
+		}
+		// waits for everything posted so far: the posts first, then what
+		// they forwarded, which is never forwarded again
+		void flush() {
+			for (auto &pShard : shards)
+				for (auto &pSession : pShard -> pSessions)
+					pSession -> flush();
+			for (auto &pShard : shards)
+				waitForLanes(*pShard, pShard -> postLanes);
+			for (auto &pShard : shards)
+				waitForLanes(*pShard, pShard -> forwardLanes);
+		}
+		// on the shard that owns the window
+		void printRecent(int UID, size_t count) {
+			flush();
+			Client &client = *clients.at(UID);
+			shards[shardOf(sessionOf(UID))] -> pSessions[sessionOf(UID) / shards.size()] -> render([&client, UID, count] {
+				std::cout << "Last " << count << " messages of " << ClientsDB::getSI() -> name(UID) << ", newest first : " << std::endl;
+				client.printRecent(std::cout, count);
+			});
+		}
+	};
+
+	// log-linear latency histogram in the manner of HdrHistogram: exact up
+	// to 127 ns, then 64 buckets for every power of two, so any recorded
+	// value is known within about 1.6% at a fixed 30 KiB
+	class LatencyHistogram {
+		static const int subBucketBits = 6;
+		std::vector<uint64_t> counts;
+		uint64_t total = 0;
+		uint64_t maxValue = 0;
+
+		static size_t bucketOf(uint64_t value) {
+			if (value < (2u << subBucketBits))
+				return value;
+			int shift = 63 - __builtin_clzll(value) - subBucketBits;
+			return ((shift + 1) << subBucketBits) + (value >> shift) - (1u << subBucketBits);
+		}
+		// the highest value that lands in bucket
+		static uint64_t highestOf(size_t bucket) {
+			if (bucket < (2u << subBucketBits))
+				return bucket;
+			int shift = (bucket >> subBucketBits) - 1;
+			uint64_t lowest = (uint64_t)((bucket & ((1u << subBucketBits) - 1)) + (1u << subBucketBits)) << shift;
+			return lowest + ((uint64_t)1 << shift) - 1;
+		}
+	public:
+		LatencyHistogram() : counts(bucketOf(UINT64_MAX) + 1, 0) {
+		}
+		void record(uint64_t value) {
+			++counts[bucketOf(value)];
+			++total;
+			maxValue = std::max(maxValue, value);
+		}
+		void add(const LatencyHistogram &other) {
+			for (size_t bucket = 0; bucket < counts.size(); ++bucket)
+				counts[bucket] += other.counts[bucket];
+			total += other.total;
+			maxValue = std::max(maxValue, other.maxValue);
+		}
+		uint64_t count() const {
+			return total;
+		}
+		uint64_t max() const {
+			return maxValue;
+		}
+		// the value at or below which percent of the recorded ones lie
+		uint64_t percentile(double percent) const {
+			uint64_t rank = std::max<uint64_t>(1, (uint64_t)(total * percent / 100 + 0.5));
+			uint64_t seen = 0;
+			for (size_t bucket = 0; bucket < counts.size(); ++bucket)
+				if ((seen += counts[bucket]) >= rank)
+					return std::min(highestOf(bucket), maxValue);
+			return maxValue;
 		}
 	};
 
+	// post-to-delivery latency of every delivery of a load run: the text of
+	// a load message is the time it was meant to be posted at, and every
+	// delivering thread records into a histogram of its own
+	class LatencyRecorder : public DeliveryListener {
+		static std::atomic<uint64_t> nextID;
+		// a thread's cached histogram belongs to the recorder of this ID
+		const uint64_t ID = ++nextID;
+		std::mutex mutex;
+		std::vector<std::unique_ptr<LatencyHistogram>> histograms;
+
+		LatencyHistogram &local() {
+			thread_local uint64_t cachedID = 0;
+			thread_local LatencyHistogram *pCached = nullptr;
+			if (cachedID != ID) {
+				std::lock_guard<std::mutex> lock(mutex);
+				histograms.emplace_back(new LatencyHistogram());
+				pCached = histograms.back().get();
+				cachedID = ID;
+			}
+			return *pCached;
+		}
+	public:
+		static int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+		virtual void onDeliver(int, const std::shared_ptr<const Message> &pMsg) {
+			const std::string &text = pMsg -> getText();
+			int64_t postedAt = 0;
+			if (std::from_chars(text.data(), text.data() + text.size(), postedAt).ec != std::errc())
+				return;
+			local().record(std::max<int64_t>(0, now() - postedAt));
+		}
+		// once no thread delivers any more
+		LatencyHistogram merged() {
+			std::lock_guard<std::mutex> lock(mutex);
+			LatencyHistogram histogram;
+			for (auto &pHistogram : histograms)
+				histogram.add(*pHistogram);
+			return histogram;
+		}
+	};
+	std::atomic<uint64_t> LatencyRecorder::nextID(0);
+
+	// a load run: clientsCount clients in sessions of sessionSize, each
+	// posting postsPerClient broadcasts at postsPerSecond, or as fast as
+	// producersCount threads go when it is 0. A shardsCount of 0 runs every
+	// session as a ChatServer of its own, each with its own delivery thread
+	struct LoadSpec {
+		int clientsCount;
+		int sessionSize;
+		double postsPerSecond;
+		int postsPerClient;
+		int producersCount;
+		size_t shardsCount;
+	};
+	struct LoadResult {
+		size_t posted;
+		double seconds;
+		// of every delivery, in nanoseconds
+		LatencyHistogram latencies;
+		// 0 unless built with MEDIATOR_COUNT_ALLOCATIONS
+		size_t allocations;
+	};
+	// open loop: latency counts from when a post was due, so a stalled
+	// producer shows up as latency instead of as fewer posts
+	LoadResult runLoad(const LoadSpec &spec) {
+		// of sessionSize clients each, whose UIDs start at 0 on every one
+		std::vector<std::unique_ptr<ChatServer>> chatServers;
+		std::unique_ptr<ShardedChatServer> pShardedServer;
+		LatencyRecorder recorder;
+		if (spec.shardsCount) {
+			pShardedServer.reset(new ShardedChatServer(spec.clientsCount / spec.sessionSize, spec.sessionSize, spec.producersCount, spec.shardsCount));
+			pShardedServer -> setListener(&recorder);
+			pShardedServer -> flush();
+		} else
+			for (int sessionID = 0; sessionID < spec.clientsCount / spec.sessionSize; ++sessionID) {
+				chatServers.emplace_back(new ChatServer(spec.sessionSize));
+				chatServers.back() -> setListener(&recorder);
+				chatServers.back() -> flush();
+			}
+		int clientsCount = spec.clientsCount / spec.sessionSize * spec.sessionSize;
+#ifdef MEDIATOR_COUNT_ALLOCATIONS
+		size_t allocationsBefore = allocationsCount;
+#endif
+		int64_t start = LatencyRecorder::now();
+		std::vector<std::thread> producerThreads;
+		for (int index = 0; index < spec.producersCount; ++index)
+			producerThreads.emplace_back([&, index] {
+				std::unique_ptr<ShardedChatServer::Producer> pProducer;
+				if (pShardedServer)
+					pProducer.reset(new ShardedChatServer::Producer(pShardedServer -> producer(index)));
+				// this thread's clients take turns, one post each per round
+				std::vector<int> UIDs;
+				for (int UID = index; UID < clientsCount; UID += spec.producersCount)
+					UIDs.push_back(UID);
+				double interval = spec.postsPerSecond > 0 ? 1e9 / (spec.postsPerSecond * UIDs.size()) : 0;
+				char digits[24];
+				for (int64_t post = 0; post < (int64_t)UIDs.size() * spec.postsPerClient; ++post) {
+					int64_t dueAt = LatencyRecorder::now();
+					if (interval > 0) {
+						dueAt = start + (int64_t)(post * interval);
+						std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(dueAt)));
+					}
+					int UID = UIDs[post % UIDs.size()];
+					std::string text(digits, std::to_chars(digits, digits + sizeof(digits), dueAt).ptr);
+					if (pProducer) {
+						std::unique_ptr<Message> pMsg(new Message(text, UID));
+						pProducer -> postMsg(pMsg);
+					} else {
+						std::unique_ptr<Message> pMsg(new Message(text, UID % spec.sessionSize));
+						chatServers[UID / spec.sessionSize] -> postMsg(pMsg);
+					}
+				}
+			});
+		for (auto &producerThread : producerThreads)
+			producerThread.join();
+		if (pShardedServer)
+			pShardedServer -> flush();
+		for (auto &pChatServer : chatServers)
+			pChatServer -> flush();
+		LoadResult result{(size_t)clientsCount * spec.postsPerClient, (LatencyRecorder::now() - start) / 1e9, LatencyHistogram(), 0};
+#ifdef MEDIATOR_COUNT_ALLOCATIONS
+		result.allocations = allocationsCount - allocationsBefore;
+#endif
+		if (pShardedServer) {
+			pShardedServer -> setListener(nullptr);
+			pShardedServer -> flush();
+		}
+		for (auto &pChatServer : chatServers) {
+			pChatServer -> setListener(nullptr);
+			pChatServer -> flush();
+		}
+		result.latencies = recorder.merged();
+		return result;
+	}
+	std::ostream &operator<<(std::ostream &os, const LoadResult &result) {
+		os << (long long)(result.posted / result.seconds) << " posts/s, ";
+		os << (long long)(result.latencies.count() / result.seconds) << " deliveries/s, latency us";
+		std::ios_base::fmtflags flags = os.flags();
+		std::streamsize precision = os.precision();
+		os << std::fixed << std::setprecision(1);
+		os << " p50 " << result.latencies.percentile(50) / 1000.0;
+		os << " p99 " << result.latencies.percentile(99) / 1000.0;
+		os << " p999 " << result.latencies.percentile(99.9) / 1000.0;
+		os << " max " << result.latencies.max() / 1000.0;
+#ifdef MEDIATOR_COUNT_ALLOCATIONS
+		os << ", allocations/msg " << (double)result.allocations / result.posted;
+#endif
+		os.flags(flags);
+		os.precision(precision);
+		return os;
+	}
+
 	void TestSuite() {
 		std::unique_ptr<ChatServer> pChatServer(new ChatServer());
 
@@ -236,5 +2279,114 @@ namespace Mediator {
 		// the message comes in form the client
 		std::unique_ptr<Message> pMsg3(new Message("Let's go for some coffee!", 2));
 		pChatServer -> postMsg(pMsg3, true);
+
+		// every client posting from its own thread at once
+		std::vector<std::thread> clientThreads;
+		for (const auto &t : ClientsDB::getSI() -> clients())
+			clientThreads.emplace_back([&pChatServer, UID = t.first] {
+				for (int idx = 0; idx < 1000; ++idx) {
+					std::unique_ptr<Message> pMsg(new Message("Message " + std::to_string(idx), UID));
+					pChatServer -> postMsg(pMsg);
+				}
+			});
+		for (auto &clientThread : clientThreads)
+			clientThread.join();
+		pChatServer -> print(0);
+		pChatServer -> printRecent(1, 3);
+
+		// routing: a direct message, a room, a mute and an online-only notice
+		std::unique_ptr<ChatServer> pRoutingServer(new ChatServer());
+		std::unique_ptr<Message> pDirect(new Message("Just between us", 0, {1}));
+		pRoutingServer -> postMsg(pDirect);
+		pRoutingServer -> joinRoom(7, 1);
+		pRoutingServer -> joinRoom(7, 2);
+		std::unique_ptr<Message> pRoomMsg(new Message("Room 7 only", 2));
+		pRoomMsg -> setRoomID(7);
+		pRoutingServer -> postMsg(pRoomMsg);
+		pRoutingServer -> mute(1, 0);
+		std::unique_ptr<Message> pMuted(new Message("Olga muted me", 0));
+		pRoutingServer -> postMsg(pMuted);
+		pRoutingServer -> setOnline(2, false);
+		std::unique_ptr<Message> pNotice(new Message("Andrii is typing", 0));
+		pNotice -> setOnlineOnly(true);
+		pRoutingServer -> postMsg(pNotice, true);
+
+		// a logged server, then a restarted one rebuilding its windows from the log
+		std::string logDirectory = (std::filesystem::temp_directory_path() / ("mediator-log-" + std::to_string(getpid()))).string();
+		{
+			std::unique_ptr<ChatServer> pLoggedServer(new ChatServer());
+			pLoggedServer -> attachLog(std::make_shared<MessageLog>(logDirectory, 4096));
+			for (int idx = 0; idx < 100; ++idx) {
+				std::unique_ptr<Message> pMsg(new Message("Logged message " + std::to_string(idx), idx % 3));
+				pLoggedServer -> postMsg(pMsg);
+			}
+			std::unique_ptr<Message> pDirectLogged(new Message("Logged just between us", 2, {0}));
+			pLoggedServer -> postMsg(pDirectLogged);
+			pLoggedServer -> flush();
+		}
+		std::unique_ptr<ChatServer> pRestartedServer(new ChatServer());
+		pRestartedServer -> attachLog(std::make_shared<MessageLog>(logDirectory, 4096));
+		pRestartedServer -> printRecent(1, 3);
+		pRestartedServer -> printHistory(0, 3);
+		pRestartedServer.reset();
+		std::filesystem::remove_all(logDirectory);
+
+		// the same clients over the loopback, through the network front end
+		std::unique_ptr<ChatServer> pNetworkServer(new ChatServer());
+		{
+			ChatFrontEnd frontEnd(*pNetworkServer, 0, 2);
+			LoadReport report = generateLoad(frontEnd.getPort(), pNetworkServer -> clientsCount(), 100);
+			std::cout << "Loopback : " << report.posted << " posted, " << report.delivered << " delivered" << std::endl;
+		}
+		{
+			// a new front end, the old one may not have seen those clients go yet
+			ChatFrontEnd frontEnd(*pNetworkServer, 0, 2);
+			ChatClient olga(frontEnd.getPort(), 1);
+			olga.post("Over the network, just between us", {2});
+			olga.send();
+			ChatClient::Delivery delivery;
+			if (olga.receive(delivery))
+				std::cout << "Olga got back : " << delivery.text << std::endl;
+		}
+		pNetworkServer -> printRecent(2, 1);
+
+		// four sessions of three on two shards: a broadcast stays in its
+		// session, a direct message reaches clients of other sessions
+		std::unique_ptr<ShardedChatServer> pShardedServer(new ShardedChatServer(4, 3, 2, 2));
+		ShardedChatServer::Producer producer0 = pShardedServer -> producer(0);
+		ShardedChatServer::Producer producer1 = pShardedServer -> producer(1);
+		std::unique_ptr<Message> pSessionMsg(new Message("Hello, session 0", 0));
+		producer0.postMsg(pSessionMsg);
+		std::unique_ptr<Message> pAcrossMsg(new Message("Hello from session 1", 4, {0, 10}));
+		producer1.postMsg(pAcrossMsg);
+		pShardedServer -> printRecent(1, 2);
+		pShardedServer -> printRecent(0, 2);
+		pShardedServer -> printRecent(10, 2);
+
+		// a short load run, every delivery gets its latency recorded
+		LoadResult result = runLoad({48, 12, 0, 25, 2, 2});
+		std::cout << "Load : " << result.posted << " posts, " << result.latencies.count() << " deliveries recorded" << std::endl;
+	}
+
+	void BenchmarkSuite() {
+		// loopback load through one event loop per core
+		for (int clientsCount : {4, 16, 64}) {
+			std::unique_ptr<ChatServer> pChatServer(new ChatServer(clientsCount));
+			ChatFrontEnd frontEnd(*pChatServer);
+			LoadReport report = generateLoad(frontEnd.getPort(), clientsCount, 128000 / clientsCount / clientsCount * 4);
+			std::cout << "Loopback, " << clientsCount << " clients : " << (long long)(report.posted / report.seconds) << " posts/s, ";
+			std::cout << (long long)(report.delivered / report.seconds) << " deliveries/s" << std::endl;
+		}
+
+		// 256 clients as fast as 4 threads post, then at 100 posts/s each:
+		// sessions of 16, each a ChatServer with its own delivery thread, then
+		// over 1, 2 and 4 shards
+		for (double postsPerSecond : {0.0, 100.0}) {
+			std::cout << "Load, 256 clients, " << (postsPerSecond > 0 ? std::to_string((int)postsPerSecond) + " posts/s each" : "as fast as possible") << std::endl;
+			for (size_t shardsCount : {0, 1, 2, 4}) {
+				LoadResult result = runLoad({256, 16, postsPerSecond, postsPerSecond > 0 ? 100 : 400, 4, shardsCount});
+				std::cout << "  " << (shardsCount ? std::to_string(shardsCount) + " shards : " : "16 servers : ") << result << std::endl;
+			}
+		}
 	}
 }